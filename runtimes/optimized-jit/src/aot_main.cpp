@@ -0,0 +1,75 @@
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "interpreter.hpp"
+#include "um_state.hpp"
+
+extern "C" {
+    #include "virt.h"
+}
+
+/* Defined in the object written by --emit-obj: the program it was compiled
+ * from, and the main loop over its regions, which the JIT calls main */
+extern "C" const uint32_t um_segment_zero[];
+extern "C" const uint32_t um_segment_zero_size;
+extern "C" uint32_t um_main(UMState* state);
+
+/* Sends gotos back to compiled code, except to targets it already missed,
+ * until segment 0 is written or replaced and no longer matches the program
+ * that was compiled */
+class CompiledObserver : public GotoObserver {
+    public:
+        std::vector<bool> missed;
+        bool compiledValid = true;
+
+        explicit CompiledObserver(size_t words) : missed(words, false) {}
+
+        bool onGoto(uint32_t target) override
+        {
+            return compiledValid && target < missed.size() && !missed[target];
+        }
+};
+
+/* Entry point of an executable built with --emit-exe. Runs the program
+ * compiled ahead of time, and interprets whatever it has no code for: gotos
+ * the static scan missed, and everything after a load program or a store
+ * into segment 0. */
+int main()
+{
+    uint8_t *umem = init_memory_system(KERN_SIZE);
+
+    kern_realloc(um_segment_zero_size * sizeof(uint32_t));
+    for (uint32_t i = 0; i < um_segment_zero_size; i++) {
+        set_at(umem, i * sizeof(uint32_t), um_segment_zero[i]);
+    }
+
+    // Nothing says whether the object read segment 0 as a constant, so a
+    // store into it always hands over to the interpreter for good
+    um_segment_zero_assumed = 1;
+
+    UMState state = {};
+    CompiledObserver observer(um_segment_zero_size);
+    UMExit exit = static_cast<UMExit>(um_main(&state));
+
+    while (exit != UM_EXIT_HALT) {
+        if (exit == UM_EXIT_RELOAD) {
+            observer.compiledValid = false;
+        } else if (exit == UM_EXIT_MISS) {
+            if (state.pc >= um_segment_zero_size) {
+                std::cerr << "goto outside of segment 0: " << state.pc << std::endl;
+                return EXIT_FAILURE;
+            }
+            observer.missed[state.pc] = true;
+        }
+
+        exit = interpret(state, observer);
+        if (exit == UM_EXIT_JUMP) {
+            exit = static_cast<UMExit>(um_main(&state));
+        }
+    }
+
+    terminate_memory_system();
+    return 0;
+}
@@ -2,10 +2,21 @@
 #include <iostream>
 #include "llvm/ExecutionEngine/Orc/LLJIT.h"
 #include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ObjectTransformLayer.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/TargetParser/SubtargetFeature.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Linker/Linker.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
 
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Passes/PassBuilder.h"
@@ -18,6 +29,16 @@
 #include "llvm/Transforms/Utils/Mem2Reg.h"
 // #include "llvm/Transforms/Utils/SimplifyCFGOptions.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
+#include "llvm/Transforms/IPO/GlobalDCE.h"
+#include "llvm/Transforms/Scalar/DeadStoreElimination.h"
+#include "llvm/Transforms/Scalar/EarlyCSE.h"
+#include "llvm/Transforms/Scalar/LICM.h"
+#include "llvm/Transforms/Scalar/LoopIdiomRecognize.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Scalar/SimpleLoopUnswitch.h"
+#include "llvm/Transforms/Scalar/SROA.h"
+#include <cstring>
 
 
 
@@ -25,6 +46,106 @@ extern "C" {
     #include "virt.h"
 }
 
+/* The compiler LLJIT would otherwise use, timing codegen and counting the
+ * machine code it makes when there is telemetry to report to */
+class TimedIRCompiler : public llvm::orc::IRCompileLayer::IRCompiler {
+    private:
+        llvm::orc::ConcurrentIRCompiler compile;
+        CompileTelemetry* telemetry;
+
+    public:
+        TimedIRCompiler(llvm::orc::JITTargetMachineBuilder JTMB,
+                        llvm::ObjectCache* cache, CompileTelemetry* telemetry)
+            : IRCompiler(llvm::orc::irManglingOptionsFromTargetOptions(JTMB.getOptions())),
+              compile(std::move(JTMB), cache),
+              telemetry(telemetry)
+        {}
+
+        llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> operator()(llvm::Module& M) override
+        {
+            if (!telemetry) {
+                return compile(M);
+            }
+            auto start = CompileTelemetry::now();
+            auto object = compile(M);
+            if (object) {
+                telemetry->addTime(PHASE_CODEGEN, CompileTelemetry::since(start));
+                telemetry->addObject((*object)->getMemBufferRef());
+            }
+            return object;
+        }
+};
+
+// When this thread last had an object ready to link, so emitTimed can time
+// the link that follows
+static thread_local std::chrono::steady_clock::time_point objectReady;
+
+/* Called by a lazy stub if its region could not be compiled */
+static void reportLazyCompileFailure()
+{
+    std::cerr << "Failed to compile UM region" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+/* Defines one region body. Nothing is translated until a lazy call-through
+ * stub for the region is first hit, so cold regions cost nothing. */
+class RegionMaterializationUnit : public llvm::orc::MaterializationUnit {
+    private:
+        Compiler& compiler;
+        size_t region;
+
+        void discard(const llvm::orc::JITDylib& JD,
+                     const llvm::orc::SymbolStringPtr& name) override {}
+
+    public:
+        RegionMaterializationUnit(Compiler& compiler, size_t region,
+                                  llvm::orc::SymbolStringPtr name)
+            : MaterializationUnit(Interface(
+                  llvm::orc::SymbolFlagsMap{
+                      {name, llvm::JITSymbolFlags::Exported |
+                                 llvm::JITSymbolFlags::Callable}},
+                  nullptr)),
+              compiler(compiler),
+              region(region) {}
+
+        llvm::StringRef getName() const override {
+            return "UMRegion";
+        }
+
+        void materialize(
+            std::unique_ptr<llvm::orc::MaterializationResponsibility> R) override {
+            compiler.emitRegion(std::move(R), region);
+        }
+};
+
+/* Defines main. The tiered runtime calls regions itself and never looks it
+ * up, so it is only built, and counted in the telemetry, when it runs. */
+class MainMaterializationUnit : public llvm::orc::MaterializationUnit {
+    private:
+        Compiler& compiler;
+
+        void discard(const llvm::orc::JITDylib& JD,
+                     const llvm::orc::SymbolStringPtr& name) override {}
+
+    public:
+        MainMaterializationUnit(Compiler& compiler, llvm::orc::SymbolStringPtr name)
+            : MaterializationUnit(Interface(
+                  llvm::orc::SymbolFlagsMap{
+                      {name, llvm::JITSymbolFlags::Exported |
+                                 llvm::JITSymbolFlags::Callable}},
+                  nullptr)),
+              compiler(compiler) {}
+
+        llvm::StringRef getName() const override {
+            return "UMMain";
+        }
+
+        void materialize(
+            std::unique_ptr<llvm::orc::MaterializationResponsibility> R) override {
+            compiler.emitMain(std::move(R));
+        }
+};
+
 // Compiler::Compiler() : builder(context)
 
 // {
@@ -175,28 +296,54 @@ extern "C" {
 
 // }
 
-Compiler::Compiler() : builder(context)
+Compiler::Compiler(const CompilerOptions& options)
+    : tsc(std::make_unique<llvm::LLVMContext>()),
+      context(*tsc.getContext()),
+      builder(context),
+      memoryTags(context),
+      options(options)
 {
     llvm::InitializeNativeTarget();
     llvm::InitializeNativeTargetAsmPrinter();
     llvm::InitializeNativeTargetAsmParser();
 
-    module = std::make_unique<llvm::Module>("um_program", context);
-    module->setTargetTriple("arm64-apple-macosx15.0.0");
+    // Initialize JIT
+    if (auto err = initializeJIT()) {
+        std::cerr << "Failed to init JIT" << std::endl;
+    }
+}
 
-    // Function takes no parameters now
+void Compiler::createModule(const std::string& functionName)
+{
+    module = std::make_unique<llvm::Module>(functionName, context);
+    module->setTargetTriple(targetTriple);
+    module->setDataLayout(dataLayout);
+
+    // Blocks belong to the previous module, so forget about them
+    instructionLabels.clear();
+    dispatchBlock = nullptr;
+    dispatchTable = nullptr;
+    segmentZeroGlobal = nullptr;
+    haltBlock = nullptr;
+    missBlock = nullptr;
+    reloadBlock = nullptr;
+    leaveBlock = nullptr;
+
+    // Regions take the UMState the driver keeps between calls
     llvm::FunctionType* funcType = llvm::FunctionType::get(
         llvm::Type::getInt32Ty(context),
-        {}, // No parameters
+        {llvm::PointerType::getUnqual(context)},
         false
     );
 
     currentFunction = llvm::Function::Create(
         funcType,
         llvm::Function::ExternalLinkage,
-        "main",
+        functionName,
         module.get()
     );
+    statePtr = currentFunction->getArg(0);
+    statePtr->setName("state");
 
     llvm::BasicBlock* entryBlock = llvm::BasicBlock::Create(
         context,
@@ -205,30 +352,37 @@ Compiler::Compiler() : builder(context)
     );
     builder.SetInsertPoint(entryBlock);
 
-    // Remove the problematic parameter handling
-    usableMemPtr = builder.CreateAlloca(
-        llvm::PointerType::getUnqual(context),
-        nullptr,
-        "usable_mem_ptr"
-    );
-    
-    // Initialize with null
-    llvm::Value* nullPtr = llvm::ConstantPointerNull::get(
-        llvm::PointerType::getUnqual(context)
-    );
-    builder.CreateStore(nullPtr, usableMemPtr);
-
     // Set up external functions
     setupExternalFunctions(); // Make sure this method exists
+    addressState();
+
+    registerSSA = SSABuilder(8, llvm::Type::getInt32Ty(context));
+    dirtyRegisters = 0;
+    registerSSA.sealBlock(entryBlock);
+    landingBlocks.clear();
+    blockFunctions.clear();
+
+    // In SSA form the registers stay in the state until a block needs them,
+    // and the pc is kept there directly
+    if (options.ssaRegisters) {
+        nextInstructionPtr = nullptr;
+        return;
+    }
 
-    // Initialize registers
+    // Initialize registers from the saved state
     for (int i = 0; i < 8; i++) {
         registers[i] = builder.CreateAlloca(
             llvm::Type::getInt32Ty(context),
             nullptr,
             "reg" + std::to_string(i)
         );
-        setRegisterValues(i, 0);
+        llvm::LoadInst* saved = builder.CreateLoad(
+            llvm::Type::getInt32Ty(context),
+            statePointer(i),
+            "saved_reg" + std::to_string(i)
+        );
+        memoryTags.tag(saved, UM_MEMORY_REGISTERS);
+        writeRegister(i, saved);
     }
 
     // Initialize next instruction pointer
@@ -237,16 +391,35 @@ Compiler::Compiler() : builder(context)
         nullptr,
         "next_instruction_ptr"
     );
-    
-    builder.CreateStore(
-        llvm::ConstantInt::get(llvm::Type::getInt32Ty(context), 0),
-        nextInstructionPtr
+
+    llvm::LoadInst* savedPc = builder.CreateLoad(
+        llvm::Type::getInt32Ty(context),
+        statePointer(8),
+        "saved_pc"
     );
+    memoryTags.tag(savedPc, UM_MEMORY_PC);
+    memoryTags.tag(builder.CreateStore(savedPc, nextInstructionPtr), UM_MEMORY_PC);
+}
 
-    // Initialize JIT
-    if (auto err = initializeJIT()) {
-        std::cerr << "Failed to init JIT" << std::endl;
+void Compiler::addressState()
+{
+    // UMState is laid out as nine consecutive words: regs[0..7], then pc.
+    // Address each slot once here so every use shares it.
+    for (unsigned slot = 0; slot < 9; slot++) {
+        stateSlots[slot] = builder.CreateConstInBoundsGEP1_32(
+            llvm::Type::getInt32Ty(context),
+            statePtr,
+            slot,
+            slot < 8 ? "state_reg" + std::to_string(slot) : "state_pc"
+        );
     }
+
+    // The arena base never moves, so load it once per entry
+    usableMem = builder.CreateLoad(
+        llvm::PointerType::getUnqual(context),
+        usableMemPtr,
+        "usable_mem_base"
+    );
 }
 
 void Compiler::setupExternalFunctions()
@@ -277,41 +450,131 @@ void Compiler::setupExternalFunctions()
         module.get()
     );
 
-    llvm::FunctionType *vsCallocType = llvm::FunctionType::get(
-        llvm::Type::getInt32Ty(context),
+    // Map and unmap are built as IR so they inline into the region
+    VirtFunctions virt = defineVirtFunctions(*module);
+    vsCallocFunc = virt.calloc;
+    vsFreeFunc = virt.free;
+
+    llvm::FunctionType *loadProgramType = llvm::FunctionType::get(
+        llvm::Type::getVoidTy(context),
         {llvm::Type::getInt32Ty(context)},
-        false // not variadic
+        false
     );
 
-    vsCallocFunc = llvm::Function::Create(
-        vsCallocType,
+    loadProgramFunc = llvm::Function::Create(
+        loadProgramType,
         llvm::Function::ExternalLinkage,
-        "vs_calloc",
+        "um_load_program",
         module.get()
     );
+    // Replacing the program is rare, so keep its path out of the hot code
+    loadProgramFunc->addFnAttr(llvm::Attribute::Cold);
 
-    llvm::FunctionType *vsFreeType = llvm::FunctionType::get(
-        llvm::Type::getVoidTy(context), //don't need void return type
-        {llvm::Type::getInt32Ty(context)},
-        false
+    usableMemPtr = new llvm::GlobalVariable(
+        *module,
+        llvm::PointerType::getUnqual(context),
+        false,
+        llvm::GlobalValue::ExternalLinkage,
+        nullptr,
+        "usable"
     );
 
-    vsFreeFunc = llvm::Function::Create(
-        vsFreeType,
-        llvm::Function::ExternalLinkage,
-        "vs_free",
-        module.get()
+    segmentZeroWrittenPtr = new llvm::GlobalVariable(
+        *module,
+        llvm::Type::getInt32Ty(context),
+        false,
+        llvm::GlobalValue::ExternalLinkage,
+        nullptr,
+        "um_segment_zero_written"
     );
 }
 
 llvm::Error Compiler::initializeJIT()
 {
-    auto jitOrErr = llvm::orc::LLJITBuilder().create();
+    auto JTMB = llvm::orc::JITTargetMachineBuilder::detectHost();
+    if (!JTMB) {
+        return JTMB.takeError();
+    }
+
+    static const llvm::CodeGenOptLevel optLevels[] = {
+        llvm::CodeGenOptLevel::None,
+        llvm::CodeGenOptLevel::Less,
+        llvm::CodeGenOptLevel::Default,
+        llvm::CodeGenOptLevel::Aggressive
+    };
+    JTMB->setCodeGenOptLevel(optLevels[std::min(options.optLevel, 3u)]);
+
+    // Tuning for another CPU starts from that CPU's features, not the host's
+    if (!options.cpu.empty()) {
+        JTMB->setCPU(options.cpu);
+        JTMB->getFeatures() = llvm::SubtargetFeatures();
+    }
+    if (!options.features.empty()) {
+        JTMB->addFeatures(llvm::SubtargetFeatures(options.features).getFeatures());
+    }
+
+    targetMachineBuilder = std::make_unique<llvm::orc::JITTargetMachineBuilder>(*JTMB);
+
+    targetTriple = JTMB->getTargetTriple().str();
+    targetCPU = JTMB->getCPU();
+    targetFeatures = JTMB->getFeatures().getString();
+    if (options.telemetry) {
+        options.telemetry->setTarget(targetTriple, targetCPU, targetFeatures);
+    }
+
+    // Objects are only reusable on the same target with the same settings
+    targetKey = CacheKey()
+        .add(targetTriple)
+        .add(targetCPU)
+        .add(targetFeatures)
+        .add(std::min(options.optLevel, 3u))
+        .add(options.ssaRegisters)
+        .add(options.blockFunctions)
+        .add(LLVM_VERSION_STRING)
+        .add(OBJECT_FORMAT_VERSION)
+        .str();
+
+    if (!options.cacheDir.empty()) {
+        objectCache = std::make_unique<DiskObjectCache>(options.cacheDir, options.cacheLimit);
+    }
+
+    // Compiled modules are written to the cache under their module identifier
+    DiskObjectCache* cache = objectCache.get();
+    CompileTelemetry* telemetry = options.telemetry;
+    llvm::orc::LLJITBuilder jitBuilder;
+    jitBuilder
+        .setJITTargetMachineBuilder(std::move(*JTMB))
+        .setCompileFunctionCreator(
+            [cache, telemetry](llvm::orc::JITTargetMachineBuilder JTMB)
+                -> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+                return std::make_unique<TimedIRCompiler>(
+                    std::move(JTMB), cache, telemetry
+                );
+            });
+
+    // Materialization moves onto a pool, so a lookup of several regions
+    // compiles them side by side
+    if (options.compileThreads > 1) {
+        jitBuilder.setNumCompileThreads(options.compileThreads);
+    }
+
+    auto jitOrErr = jitBuilder.create();
     if (not jitOrErr) {
         return jitOrErr.takeError();
     }
 
     jit = std::move(*jitOrErr);
+    dataLayout = jit->getDataLayout().getStringRepresentation();
+
+    // Objects go straight from here to the linker, on the same thread
+    if (telemetry) {
+        jit->getObjTransformLayer().setTransform(
+            [](std::unique_ptr<llvm::MemoryBuffer> object)
+                -> llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> {
+                objectReady = std::chrono::steady_clock::now();
+                return std::move(object);
+            });
+    }
 
     // C standard library stuff I don't understand at all
     auto &ES = jit->getExecutionSession();
@@ -319,28 +582,81 @@ llvm::Error Compiler::initializeJIT()
 
     auto putcharAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&putchar));
     auto getcharAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&getchar));
-    auto vsCallocAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&vs_calloc));
-    auto vsFreeAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&vs_free));
+    auto vsFreeAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&um_free_segment));
+    auto loadProgramAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&um_load_program));
+    auto usableAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&usable));
+    auto recAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&rec));
+    auto recBitsAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&rec_bits));
+    auto splitFreedAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&split_freed_segment));
+    auto reclaimAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&reclaim_segment));
+    auto zeroDroppedAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&zero_dropped_segment));
+    auto pageZeroMinAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&page_zero_min));
+    auto recCleanAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&rec_clean));
+    auto zeroingAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&background_zeroing));
+    auto popCleanAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&pop_clean_segment));
+    auto startUnusedAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&start_unused));
+    auto largeStartAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&large_start));
+    auto memsetAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&memset));
+    auto memcpyAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&memcpy));
+    auto memmoveAddr = llvm::orc::ExecutorAddr::fromPtr(reinterpret_cast<void*>(&memmove));
+    auto segmentZeroWrittenAddr = llvm::orc::ExecutorAddr::fromPtr(
+        reinterpret_cast<void*>(&um_segment_zero_written)
+    );
 
     llvm::orc::SymbolMap symbols;
     symbols[jit->mangleAndIntern("putchar")] = llvm::orc::ExecutorSymbolDef(putcharAddr, llvm::JITSymbolFlags::Exported);
     symbols[jit->mangleAndIntern("getchar")] = llvm::orc::ExecutorSymbolDef(getcharAddr, llvm::JITSymbolFlags::Exported);
-    symbols[jit->mangleAndIntern("vs_calloc")] = llvm::orc::ExecutorSymbolDef(vsCallocAddr, llvm::JITSymbolFlags::Exported);
-    symbols[jit->mangleAndIntern("vs_free")] = llvm::orc::ExecutorSymbolDef(vsFreeAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("um_free_segment")] = llvm::orc::ExecutorSymbolDef(vsFreeAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("um_load_program")] = llvm::orc::ExecutorSymbolDef(loadProgramAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("usable")] = llvm::orc::ExecutorSymbolDef(usableAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("rec")] = llvm::orc::ExecutorSymbolDef(recAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("rec_bits")] = llvm::orc::ExecutorSymbolDef(recBitsAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("split_freed_segment")] = llvm::orc::ExecutorSymbolDef(splitFreedAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("reclaim_segment")] = llvm::orc::ExecutorSymbolDef(reclaimAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("zero_dropped_segment")] = llvm::orc::ExecutorSymbolDef(zeroDroppedAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("page_zero_min")] = llvm::orc::ExecutorSymbolDef(pageZeroMinAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("rec_clean")] = llvm::orc::ExecutorSymbolDef(recCleanAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("background_zeroing")] = llvm::orc::ExecutorSymbolDef(zeroingAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("pop_clean_segment")] = llvm::orc::ExecutorSymbolDef(popCleanAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("start_unused")] = llvm::orc::ExecutorSymbolDef(startUnusedAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("large_start")] = llvm::orc::ExecutorSymbolDef(largeStartAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("memset")] = llvm::orc::ExecutorSymbolDef(memsetAddr, llvm::JITSymbolFlags::Exported);
+    // Loop idiom recognition can turn copy loops into either of these
+    symbols[jit->mangleAndIntern("memcpy")] = llvm::orc::ExecutorSymbolDef(memcpyAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("memmove")] = llvm::orc::ExecutorSymbolDef(memmoveAddr, llvm::JITSymbolFlags::Exported);
+    symbols[jit->mangleAndIntern("um_segment_zero_written")] = llvm::orc::ExecutorSymbolDef(segmentZeroWrittenAddr, llvm::JITSymbolFlags::Exported);
 
     if (auto err = JD.define(llvm::orc::absoluteSymbols(symbols))) {
         return err;
     }
 
+    // Region bodies resolve the symbols above through the main dylib
+    regionDylib = &ES.createBareJITDylib("um_regions");
+    regionDylib->addToLinkOrder(JD);
+
+    auto errorHandlerAddr = llvm::orc::ExecutorAddr::fromPtr(&reportLazyCompileFailure);
+    auto callThroughOrErr = llvm::orc::createLocalLazyCallThroughManager(
+        jit->getTargetTriple(),
+        ES,
+        errorHandlerAddr
+    );
+    if (!callThroughOrErr) {
+        return callThroughOrErr.takeError();
+    }
+    callThroughManager = std::move(*callThroughOrErr);
+
     return llvm::Error::success();
 }
 
 
 void Compiler::printIR() {
-    module->print(llvm::outs(), nullptr);
+    buildMainModule()->print(llvm::outs(), nullptr);
+    for (size_t region = 0; region < numRegions(); region++) {
+        buildRegion(region)->print(llvm::outs(), nullptr);
+    }
 }
 
-void Compiler::runOptimizationPasses() {
+void Compiler::runOptimizationPasses(llvm::Module& target) {
     //     // Create the analysis managers
     // llvm::LoopAnalysisManager LAM;
     // llvm::FunctionAnalysisManager FAM;
@@ -371,18 +687,72 @@ void Compiler::runOptimizationPasses() {
     
     // // Run the lightweight optimizations
     // MPM.run(*module, MAM);
-// Simple approach: just run mem2reg on the function directly
+    llvm::LoopAnalysisManager LAM;
     llvm::FunctionAnalysisManager FAM;
-    llvm::PassBuilder PB;
+    llvm::CGSCCAnalysisManager CGAM;
+    llvm::ModuleAnalysisManager MAM;
+
+    llvm::PassInstrumentationCallbacks callbacks;
+    if (options.telemetry) {
+        options.telemetry->instrument(callbacks);
+    }
+
+    llvm::PassBuilder PB(nullptr, llvm::PipelineTuningOptions(), std::nullopt, &callbacks);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
     PB.registerFunctionAnalyses(FAM);
-    
-    // Create a minimal function pass manager
-    llvm::FunctionPassManager FPM;
-    FPM.addPass(llvm::PromotePass());  // This should be the correct name
-    // FPM.addPass(llvm::InstCombinePass());
-    
-    // Run just on your main function
-    FPM.run(*currentFunction, FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    llvm::ModulePassManager MPM;
+
+    // Move segments that never leave the region onto the stack while map
+    // and unmap are still calls, then break them up into SSA values. With
+    // registers in allocas every segment escapes into one, so skip it.
+    if (options.ssaRegisters) {
+        llvm::FunctionPassManager FPM;
+        FPM.addPass(ScratchSegmentPass());
+        FPM.addPass(llvm::SROAPass(llvm::SROAOptions::ModifyCFG));
+        MPM.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(FPM)));
+    }
+
+    // Inline the Virt32 helpers, then drop them and any unused declarations
+    MPM.addPass(llvm::AlwaysInlinerPass());
+    MPM.addPass(llvm::GlobalDCEPass());
+
+    // With the allocator inlined, drop redundant loads and arithmetic, its
+    // loads of the recycler included. EarlyCSE uses the memory tags to see
+    // past stores to other kinds of memory; full GVN costs minutes on large
+    // regions for little more. In loops that direct gotos made, hoist the
+    // segment 0 write barrier out by unswitching on it, then turn fill
+    // loops into memset, and copy loops into memcpy or memmove wherever a
+    // check before the loop finds that safe. InstCombine waits until after
+    // the loops, as it narrows the 64 bit arena offsets that let scalar
+    // evolution prove they never wrap. Last, DSE drops stores that a later
+    // store, or the zeroing of a fresh segment, makes dead.
+    llvm::FunctionPassManager cleanup;
+    cleanup.addPass(llvm::EarlyCSEPass(true));
+    if (options.ssaRegisters) {
+        llvm::LoopPassManager LPM;
+        LPM.addPass(llvm::LICMPass());
+        LPM.addPass(llvm::SimpleLoopUnswitchPass(true));
+        LPM.addPass(llvm::LoopIdiomRecognizePass());
+        cleanup.addPass(llvm::createFunctionToLoopPassAdaptor(std::move(LPM), true));
+        cleanup.addPass(CopyLoopPass());
+    }
+    cleanup.addPass(llvm::InstCombinePass());
+    cleanup.addPass(llvm::DSEPass());
+    MPM.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(cleanup)));
+
+    if (!options.telemetry) {
+        MPM.run(target, MAM);
+        return;
+    }
+    options.telemetry->addIRSize(target, false);
+    auto start = CompileTelemetry::now();
+    MPM.run(target, MAM);
+    options.telemetry->addTime(PHASE_OPTIMIZE, CompileTelemetry::since(start));
+    options.telemetry->addIRSize(target, true);
 }
 
 
@@ -392,84 +762,48 @@ void Compiler::setRegisterValues(int reg, int value) {
         llvm::Type::getInt32Ty(context),
         value
     );
-    builder.CreateStore(constant, registers[reg]);
+    writeRegister(reg, constant);
 }
 
 // UM addition
 void Compiler::compileAddition(int regA, int regB, int regC)
 {
-    llvm::Value* valueB = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regB],
-        "load_regB"
-    );
+    llvm::Value* valueB = readRegister(regB, "load_regB");
 
-    llvm::Value* valueC = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regC],
-        "load_regC"
-    );
+    llvm::Value* valueC = readRegister(regC, "load_regC");
 
     llvm::Value* result = builder.CreateAdd(valueB, valueC, "add_result");
 
-    builder.CreateStore(result, registers[regA]);
+    writeRegister(regA, result);
 }
 
 void Compiler::compileMul(int regA, int regB, int regC) {
-    llvm::Value* valueB = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regB],
-        "load_regB"
-    );
+    llvm::Value* valueB = readRegister(regB, "load_regB");
 
-    llvm::Value* valueC = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regC],
-        "load_regC"
-    );
+    llvm::Value* valueC = readRegister(regC, "load_regC");
 
     llvm::Value* result = builder.CreateMul(valueB, valueC, "mul_result");
 
-    builder.CreateStore(result, registers[regA]);
+    writeRegister(regA, result);
 }
 
 void Compiler::compileDiv(int regA, int regB, int regC) {
-    llvm::Value *valueB = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regB],
-        "load_regB"
-    );
+    llvm::Value *valueB = readRegister(regB, "load_regB");
 
-    llvm::Value* valueC = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regC],
-        "load_regC"
-    );
+    llvm::Value* valueC = readRegister(regC, "load_regC");
 
     llvm::Value* result = builder.CreateUDiv(valueB, valueC, "div_result");
 
-    builder.CreateStore(result, registers[regA]);
+    writeRegister(regA, result);
 }
 
 void Compiler::conditionalMove(int regA, int regB, int regC) {
 
-    llvm::Value *valueC = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regC],
-        "load_regC"
-    );
+    llvm::Value *valueC = readRegister(regC, "load_regC");
 
-    llvm::Value *valueB = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regB],
-        "load_regB"
-    );
+    llvm::Value *valueB = readRegister(regB, "load_regB");
 
-    llvm::Value *currentA = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regA],
-        "load_regC"
-    );
+    llvm::Value *currentA = readRegister(regA, "load_regC");
 
     // making condition
     llvm::Value *zero = llvm::ConstantInt::get(llvm::Type::getInt32Ty(context), 0);
@@ -479,220 +813,1010 @@ void Compiler::conditionalMove(int regA, int regB, int regC) {
     llvm::Value *result = builder.CreateSelect(condition, valueB, currentA, 
         "conditional_move");
 
-    builder.CreateStore(result, registers[regA]);
+    // A lopsided move may be better as a branch; let the backend decide
+    if (currentProfile) {
+        auto move = currentProfile->moves.find(currentInstructionIndex);
+        auto* select = llvm::dyn_cast<llvm::SelectInst>(result);
+        if (move != currentProfile->moves.end() && select) {
+            select->setMetadata(
+                llvm::LLVMContext::MD_prof,
+                branchWeights({move->second.first, move->second.second})
+            );
+        }
+    }
+
+    writeRegister(regA, result);
 }
 
 void Compiler::compileNand(int regA, int regB, int regC) {
-    llvm::Value *valueB = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regB],
-        "load_regB"
-    );
+    llvm::Value *valueB = readRegister(regB, "load_regB");
 
-    llvm::Value *valueC = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regC],
-        "load_regC"
-    );
+    llvm::Value *valueC = readRegister(regC, "load_regC");
 
     llvm::Value *andResult = builder.CreateAnd(valueB, valueC, "and_result");
 
     llvm::Value *nandResult = builder.CreateNot(andResult, "nand_result");
 
-    builder.CreateStore(nandResult, registers[regA]);
+    writeRegister(regA, nandResult);
 }
 
-void Compiler::createInstructionLabels(size_t numInstructions) {
-    // Create a label for each instruction
-    for (size_t i = 0; i < numInstructions; i++) {
+void Compiler::createInstructionLabels(size_t start, size_t end) {
+    // Only leaders get a label; the rest of a run shares its leader's block
+    instructionLabels.assign(end - start, nullptr);
+    blockFunctions.assign(options.blockFunctions ? end - start : 0, nullptr);
+    for (size_t i = start; i < end; i++) {
+        if (!leaders.isLeader(i)) {
+            continue;
+        }
+
+        llvm::Function* parent = currentFunction;
+        if (options.blockFunctions) {
+            parent = llvm::Function::Create(
+                blockFunctionType(),
+                llvm::Function::InternalLinkage,
+                "um_block_" + std::to_string(i),
+                module.get()
+            );
+            parent->setCallingConv(llvm::CallingConv::GHC);
+            blockFunctions[i - start] = parent;
+        }
+
         std::string labelName = "instr_" + std::to_string(i);
         llvm::BasicBlock* label = llvm::BasicBlock::Create(
             context,
             labelName,
-            currentFunction
+            parent
         );
-        instructionLabels.push_back(label);
+        instructionLabels[i - start] = label;
     }
-}
-
-void Compiler::compileInstruction(uint32_t word)
-{
-    // Set insert point to the current instruction's label
-    builder.SetInsertPoint(instructionLabels[currentInstructionIndex]);
-    
-
-    uint32_t opcode = (word >> 28) & 0xF;
-
-    uint32_t a = 0;
-
-    uint32_t b = 0, c = 0;
 
-    c = word & 0x7;
-    b = (word >> 3) & 0x7;
-    a = (word >> 6) & 0x7;
+    // Gotos enter through a landing block that reloads the registers the
+    // goto site spilled, so a leader only merges its fallthrough and landing.
+    // Block functions get every register as an argument instead.
+    if (!options.ssaRegisters || options.blockFunctions) {
+        landingBlocks = instructionLabels;
+        return;
+    }
 
-    bool addedTerminator = false;
+    auto savedBlock = builder.GetInsertBlock();
+    auto savedPoint = builder.GetInsertPoint();
 
-    switch (opcode) {
-        case 13: {
-            // Load register
-            a = (word >> 25) & 0x7;
-            uint32_t val = word & 0x1FFFFFF;
-            setRegisterValues(a, val);
-            break;
+    landingBlocks.assign(end - start, nullptr);
+    for (size_t i = 0; i < instructionLabels.size(); i++) {
+        llvm::BasicBlock* label = instructionLabels[i];
+        if (!label) {
+            continue;
         }
 
-        case 0: {
-            conditionalMove(a, b, c);
-            break;
+        // Without a fallthrough or direct gotos the leader merges nothing
+        // and is its own landing
+        uint32_t previousOpcode = i > 0 ? (program[start + i - 1] >> 28) & 0xF : 7;
+        if ((previousOpcode == 7 || previousOpcode == 12) && !directTargets[i]) {
+            registerSSA.defineOnDemand(label, [this, label](unsigned reg) -> llvm::Value* {
+                llvm::IRBuilder<> loadBuilder(label, label->getFirstInsertionPt());
+                llvm::LoadInst* value = loadBuilder.CreateLoad(
+                    llvm::Type::getInt32Ty(context),
+                    statePointer(reg),
+                    "land_reg" + std::to_string(reg)
+                );
+                memoryTags.tag(value, UM_MEMORY_REGISTERS);
+                return value;
+            });
+            landingBlocks[i] = label;
+            continue;
         }
 
-        case 1: {
-            // assert(false);
-            compileLoad(a, b, c);
-            break;
+        llvm::BasicBlock* landing = llvm::BasicBlock::Create(
+            context,
+            "land_" + std::to_string(start + i),
+            currentFunction,
+            label
+        );
+        builder.SetInsertPoint(landing);
+        llvm::BranchInst* enter = builder.CreateBr(label);
+
+        // Only registers the code below actually reads get reloaded
+        registerSSA.defineOnDemand(landing, [this, enter](unsigned reg) -> llvm::Value* {
+            llvm::IRBuilder<> loadBuilder(enter);
+            llvm::LoadInst* value = loadBuilder.CreateLoad(
+                llvm::Type::getInt32Ty(context),
+                statePointer(reg),
+                "land_reg" + std::to_string(reg)
+            );
+            memoryTags.tag(value, UM_MEMORY_REGISTERS);
+            return value;
+        });
+        registerSSA.sealBlock(landing);
+        landingBlocks[i] = landing;
+    }
 
-        }
+    builder.SetInsertPoint(savedBlock, savedPoint);
+}
 
-        case 2: {
-            // assert(false);
-            compileStore(a, b, c);
-            break;
+void Compiler::findDirectGotos(size_t start, size_t end)
+{
+    gotoTargets.assign(end - start, {});
+    directTargets.assign(end - start, false);
+
+    // The constants each register can hold within a run, empty if unknown.
+    // Gotos usually load their target or pick between two with a move.
+    std::vector<uint32_t> known[8];
+    for (size_t i = start; i < end; i++) {
+        if (i == start || leaders.isLeader(i)) {
+            for (int reg = 0; reg < 8; reg++) {
+                known[reg].clear();
+                if (constantRegisters & (1u << reg)) {
+                    known[reg].push_back(entryRegisters[reg]);
+                }
+            }
         }
 
-        case 3: {
-            // Adding two numbers
-            compileAddition(a, b, c);
-            break;
-        }
+        uint32_t word = program[i];
+        uint32_t a = (word >> 6) & 0x7;
+        uint32_t b = (word >> 3) & 0x7;
+        uint32_t c = word & 0x7;
+        switch ((word >> 28) & 0xF) {
+            case 13:
+                known[(word >> 25) & 0x7] = {word & 0x1FFFFFF};
+                break;
+
+            case 0: {
+                if (known[c].size() == 1) {
+                    if (known[c][0] != 0) {
+                        known[a] = known[b];
+                    }
+                    break;
+                }
+                std::vector<uint32_t> merged = known[a];
+                for (uint32_t value : known[b]) {
+                    if (std::find(merged.begin(), merged.end(), value) == merged.end()) {
+                        merged.push_back(value);
+                    }
+                }
+                if (known[a].empty() || known[b].empty() || merged.size() > MAX_DIRECT_TARGETS) {
+                    merged.clear();
+                }
+                known[a] = merged;
+                break;
+            }
 
-        case 4: {
-            compileMul(a, b, c);
-            break;
+            case 1: case 3: case 4: case 5: case 6:
+                known[a].clear();
+                break;
+
+            case 8:
+                known[b].clear();
+                break;
+
+            case 11:
+                known[c].clear();
+                break;
+
+            case 12:
+                for (uint32_t target : known[c]) {
+                    if (target >= start && target < end && leaders.isLeader(target)) {
+                        gotoTargets[i - start].push_back(target);
+                        directTargets[target - start] = true;
+                    }
+                }
+                break;
         }
+    }
+}
 
-        case 5: {
-            compileDiv(a, b, c);
-            break;
-        }
+void Compiler::foldEmptyLandingBlocks()
+{
+    if (!options.ssaRegisters) {
+        return;
+    }
 
-        case 6: {
-            compileNand(a, b, c);
-            break;
+    // A landing block nobody read through reloads nothing, and its leader
+    // has no phis, so gotos can enter the leader directly
+    for (size_t i = 0; i < landingBlocks.size(); i++) {
+        llvm::BasicBlock* landing = landingBlocks[i];
+        llvm::BasicBlock* label = instructionLabels[i];
+        if (landing == label || landing->size() != 1) {
+            continue;
         }
+        landing->replaceAllUsesWith(label);
+        landing->eraseFromParent();
+        landingBlocks[i] = label;
+    }
+}
 
-        case 7: {
-            // Halt instruction
-            if (!haltBlock) {
-                createHaltBlock();
-            }
-            builder.CreateBr(haltBlock);
-            addedTerminator = true;
-            break;
-        }
+llvm::Value* Compiler::readRegister(int reg, const std::string& name)
+{
+    if (constantRegisters & (1u << reg)) {
+        return builder.getInt32(entryRegisters[reg]);
+    }
+    if (options.ssaRegisters) {
+        return registerSSA.readVariable(reg, builder.GetInsertBlock());
+    }
+    llvm::LoadInst* value = builder.CreateLoad(llvm::Type::getInt32Ty(context), registers[reg], name);
+    memoryTags.tag(value, UM_MEMORY_REGISTERS);
+    return value;
+}
 
-        case 8: {
-            // Map segment
-            compileMap(b, c);
-            break;
-        }
+void Compiler::writeRegister(int reg, llvm::Value* value)
+{
+    if (options.ssaRegisters) {
+        registerSSA.writeVariable(reg, builder.GetInsertBlock(), value);
+        dirtyRegisters |= 1u << reg;
+        return;
+    }
+    memoryTags.tag(builder.CreateStore(value, registers[reg]), UM_MEMORY_REGISTERS);
+}
 
-        case 9: {
-            // Unmap segment
-            compileUnmap(c);
-            break;
+void Compiler::spillRegisters()
+{
+    if (!options.ssaRegisters) {
+        return;
+    }
+    // A register nobody wrote still holds what the state holds
+    for (int reg = 0; reg < 8; reg++) {
+        if (dirtyRegisters & (1u << reg)) {
+            memoryTags.tag(
+                builder.CreateStore(readRegister(reg, ""), statePointer(reg)),
+                UM_MEMORY_REGISTERS
+            );
         }
+    }
+}
 
-        case 10: {
-            // add some IR to print out a particular register.
-            printRegister(c);
-            break;
-        }
+llvm::Value* Compiler::pcPointer()
+{
+    return options.ssaRegisters ? statePointer(8) : nextInstructionPtr;
+}
 
-        case 11: {
-            readIntoRegister(c);
-            break;
+void Compiler::compileProgram(const std::vector<uint32_t>& words, const UMState* entry)
+{
+    program = words;
+    leaders = LeaderAnalysis(program);
+    regionVersions.assign(numRegions(), 0);
+
+    // A register no instruction writes keeps its value until the next load
+    // program, so it can be a constant. Data words count as instructions
+    // here, which only makes this more conservative.
+    uint32_t written = 0;
+    for (uint32_t word : program) {
+        uint32_t opcode = word >> 28;
+        if (opcode == 13) {
+            written |= 1u << ((word >> 25) & 0x7);
+        } else if (opcode <= 6 && opcode != 2) {
+            written |= 1u << ((word >> 6) & 0x7);
+        } else if (opcode == 8) {
+            written |= 1u << ((word >> 3) & 0x7);
+        } else if (opcode == 11) {
+            written |= 1u << (word & 0x7);
         }
+    }
+    constantRegisters = ~written & 0xFF;
+    for (int reg = 0; reg < 8; reg++) {
+        entryRegisters[reg] = entry ? entry->regs[reg] : 0;
+    }
 
-        case 12: {
-            // load program
-            // std::cerr << "Trying to load program\n";
-            // assert(false);
-            compileLoadProgram(b, c);
-            addedTerminator = true;  // jumpToDispatch adds the terminator
-            break;
+    // Start from whatever an earlier run recorded for this program
+    regionProfiles.assign(numRegions(), RegionProfile());
+    if (profile) {
+        // We are here because the program before wrote segment 0
+        if (um_segment_zero_written) {
+            profile->markSegmentZeroWritten();
         }
+        profile->selectProgram(program);
+        for (size_t region = 0; region < numRegions(); region++) {
+            regionProfiles[region] = profile->region(region);
+        }
+    }
 
+    // Until the program writes segment 0, loads from it read the program.
+    // A program known to write it is not worth compiling twice.
+    segmentZeroConstant = !um_segment_zero_written
+        && !(profile && profile->writesSegmentZero());
+    um_segment_zero_assumed = segmentZeroConstant;
+
+    // Every region must be enterable from the main loop
+    for (size_t region = 0; region < numRegions(); region++) {
+        leaders.addLeader(region << REGION_SHIFT);
     }
 
-    // Only add branch to next instruction if:
-    // 1. We didn't already add a terminator
-    // 2. There is a next instruction
-    if (!addedTerminator && currentInstructionIndex + 1 < instructionLabels.size()) {
-        builder.CreateBr(instructionLabels[currentInstructionIndex + 1]);
+    if (options.telemetry) {
+        options.telemetry->setProgram(program.size(), numRegions());
     }
-    
-    currentInstructionIndex++;
-}
 
-// Original
-void Compiler::compileLoadProgram(int regB, int regC) {
-    // Load the target instruction index from register B
-    llvm::Value* targetIndex = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regC],
-        "load_target_index"
-    );
-    
-    // Store it as the next instruction to execute
-    builder.CreateStore(targetIndex, nextInstructionPtr);
-    
-    // Jump to dispatch
-    jumpToDispatch();
+    if (objectCache) {
+        std::vector<uint32_t> constants(entryRegisters, entryRegisters + 8);
+        constants.push_back(constantRegisters);
+        constants.push_back(segmentZeroConstant);
+        // Counts read with --profile-in shape the code, so they are part of
+        // the key; what tiering counts after that is left out
+        std::string profileKey = profile ? profile->loadedFrom() : "";
+        programKey = CacheKey().add(targetKey).add(program).add(constants).add(profileKey).str();
+    }
 }
 
-void Compiler::printRegister(int regC)
+/* Translates and code generates every region with each register lowering,
+ * without running anything, and reports where the time went */
+void Compiler::benchmarkCompile()
 {
-    llvm::Value* charValue = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regC],
-        "putchar_value"
-    );
+    auto targetMachine = targetMachineBuilder->createTargetMachine();
+    if (!targetMachine) {
+        std::cerr << "Failed to create target machine: "
+                  << llvm::toString(targetMachine.takeError()) << std::endl;
+        return;
+    }
+    llvm::orc::SimpleCompiler compile(**targetMachine);
 
-    // call putchar with register value
-    builder.CreateCall(putcharFunc, {charValue}, "putchar_call");
-}
+    bool savedSSA = options.ssaRegisters;
+    bool savedBlocks = options.blockFunctions;
+    llvm::outs() << "mode      regions instructions    build_s  codegen_s object_bytes\n";
 
-void Compiler::readIntoRegister(int regC)
-{
-    llvm::Value* inputChar = builder.CreateCall(getcharFunc, {}, "getchar_call");
+    static const char* const modes[] = {"alloca", "ssa", "blocks"};
+    for (int mode = 0; mode < 3; mode++) {
+        options.ssaRegisters = mode > 0;
+        options.blockFunctions = mode == 2;
 
-    builder.CreateStore(inputChar, registers[regC]);
-}
+        size_t instructions = 0;
+        size_t objectBytes = 0;
+        double buildSeconds = 0;
+        double codegenSeconds = 0;
 
-void Compiler::compileMap(int regB, int regC)
+        for (size_t region = 0; region < numRegions(); region++) {
+            auto start = std::chrono::steady_clock::now();
+            auto regionModule = buildRegion(region);
+            auto built = std::chrono::steady_clock::now();
+
+            for (llvm::Function& function : *regionModule) {
+                instructions += function.getInstructionCount();
+            }
+
+            auto object = compile(*regionModule);
+            auto compiled = std::chrono::steady_clock::now();
+            if (!object) {
+                std::cerr << "Failed to compile region " << region << ": "
+                          << llvm::toString(object.takeError()) << std::endl;
+                options.ssaRegisters = savedSSA;
+                options.blockFunctions = savedBlocks;
+                return;
+            }
+            objectBytes += (*object)->getBufferSize();
+
+            buildSeconds += std::chrono::duration<double>(built - start).count();
+            codegenSeconds += std::chrono::duration<double>(compiled - built).count();
+        }
+
+        llvm::outs() << llvm::format("%-8s %8zu %12zu %10.3f %10.3f %12zu\n",
+                                     modes[mode], numRegions(), instructions,
+                                     buildSeconds, codegenSeconds, objectBytes);
+    }
+
+    options.ssaRegisters = savedSSA;
+    options.blockFunctions = savedBlocks;
+}
+
+/* Builds main and every region into one module, as the JIT would run them
+ * with all the lazy stubs resolved, and writes it out as a relocatable
+ * object. The program goes in with it as um_segment_zero, for the constant
+ * segment 0 loads and for aot_main.cpp to load into the arena. */
+llvm::Error Compiler::emitObject(const std::string& path)
 {
-    llvm::Value* mapSize = builder.CreateLoad(
+    auto buildStart = CompileTelemetry::now();
+    std::unique_ptr<llvm::Module> linked = buildMainModule();
+    linked->setModuleIdentifier("um_program");
+
+    // The C entry point in aot_main.cpp already has the name main
+    linked->getFunction("main")->setName("um_main");
+
+    llvm::Constant* words = llvm::ConstantDataArray::get(
+        context,
+        llvm::ArrayRef<uint32_t>(program)
+    );
+    new llvm::GlobalVariable(
+        *linked,
+        words->getType(),
+        true,
+        llvm::GlobalValue::ExternalLinkage,
+        words,
+        "um_segment_zero"
+    );
+    new llvm::GlobalVariable(
+        *linked,
         llvm::Type::getInt32Ty(context),
-        registers[regC],
-        "load_map_size"
+        true,
+        llvm::GlobalValue::ExternalLinkage,
+        llvm::ConstantInt::get(llvm::Type::getInt32Ty(context), program.size()),
+        "um_segment_zero_size"
     );
 
-    llvm::Value* mapResult = builder.CreateCall(vsCallocFunc, {mapSize}, "vs_calloc_call");
+    if (options.telemetry) {
+        options.telemetry->addTime(PHASE_BUILD, CompileTelemetry::since(buildStart));
+    }
+
+    llvm::Linker linker(*linked);
+    for (size_t region = 0; region < numRegions(); region++) {
+        auto regionModule = buildRegion(region);
+
+        // Called straight from the region table, with no stub in between
+        regionModule->getFunction(regionSymbol(region))
+            ->setName("um_region_" + std::to_string(region));
+
+        auto linkStart = CompileTelemetry::now();
+        bool failed = linker.linkInModule(std::move(regionModule));
+        if (options.telemetry) {
+            options.telemetry->addTime(PHASE_LINK, CompileTelemetry::since(linkStart));
+        }
+        if (failed) {
+            return llvm::make_error<llvm::StringError>(
+                "Failed to link region " + std::to_string(region),
+                llvm::inconvertibleErrorCode()
+            );
+        }
+    }
+
+    std::string errorStr;
+    llvm::raw_string_ostream errorStream(errorStr);
+    if (llvm::verifyModule(*linked, &errorStream)) {
+        return llvm::make_error<llvm::StringError>(
+            "Module verification failed: " + errorStr,
+            llvm::inconvertibleErrorCode()
+        );
+    }
+
+    // Position independent, so it links into a PIE like any other object
+    llvm::orc::JITTargetMachineBuilder objectMachineBuilder(*targetMachineBuilder);
+    objectMachineBuilder.setRelocationModel(llvm::Reloc::PIC_);
+    auto targetMachine = objectMachineBuilder.createTargetMachine();
+    if (!targetMachine) {
+        return targetMachine.takeError();
+    }
+
+    llvm::orc::SimpleCompiler compile(**targetMachine);
+    auto codegenStart = CompileTelemetry::now();
+    auto object = compile(*linked);
+    if (!object) {
+        return object.takeError();
+    }
+    if (options.telemetry) {
+        options.telemetry->addTime(PHASE_CODEGEN, CompileTelemetry::since(codegenStart));
+        options.telemetry->addObject((*object)->getMemBufferRef());
+    }
 
-    builder.CreateStore(mapResult, registers[regB]);
+    std::error_code ec;
+    llvm::raw_fd_ostream out(path, ec, llvm::sys::fs::OF_None);
+    if (ec) {
+        return llvm::errorCodeToError(ec);
+    }
+    out << (*object)->getBuffer();
+    return llvm::Error::success();
 }
 
-void Compiler::compileUnmap(int regC)
+void Compiler::printTarget()
 {
-    llvm::Value *freeAddr = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regC],
-        "unmap_addr"
+    llvm::outs() << "triple: " << targetTriple << "\n";
+    llvm::outs() << "cpu: " << targetCPU << "\n";
+    llvm::outs() << "features: " << targetFeatures << "\n";
+    llvm::outs() << "datalayout: " << dataLayout << "\n";
+}
+
+size_t Compiler::numRegions() const
+{
+    return (program.size() + REGION_WORDS - 1) >> REGION_SHIFT;
+}
+
+std::string Compiler::regionKey(size_t region) const
+{
+    // Misses add leaders, which changes the region's code
+    size_t start = region << REGION_SHIFT;
+    size_t end = std::min(start + REGION_WORDS, program.size());
+    std::vector<uint32_t> leaderBits((end - start + 31) / 32);
+    for (size_t i = start; i < end; i++) {
+        if (leaders.isLeader(i)) {
+            leaderBits[(i - start) / 32] |= 1u << ((i - start) % 32);
+        }
+    }
+
+    return CacheKey().add(programKey).add(regionSymbol(region)).add(leaderBits).str();
+}
+
+std::string Compiler::mainKey() const
+{
+    // Main bounds the pc by the size of segment 0, not just its region count
+    return CacheKey().add(targetKey).add("um_main").add(program.size()).str();
+}
+
+std::unique_ptr<llvm::Module> Compiler::buildRegion(size_t region)
+{
+    auto regionModule = translateRegion(region);
+    runOptimizationPasses(*regionModule);
+    return regionModule;
+}
+
+std::unique_ptr<llvm::Module> Compiler::translateRegion(size_t region)
+{
+    auto buildStart = CompileTelemetry::now();
+    size_t start = region << REGION_SHIFT;
+    size_t end = std::min(start + REGION_WORDS, program.size());
+
+    regionStart = start;
+    currentProfile = region < regionProfiles.size() && !regionProfiles[region].empty()
+        ? &regionProfiles[region]
+        : nullptr;
+    createModule(regionSymbol(region));
+    findDirectGotos(start, end);
+    createInstructionLabels(start, end);
+    createDispatchTable();
+
+    // Enter through the dispatcher so the driver can resume at any leader
+    jumpToFirstInstruction();
+
+    currentInstructionIndex = start;
+    for (size_t i = start; i < end; i++) {
+        compileInstruction(program[i]);
+    }
+    for (size_t i = 0; i < directTargets.size(); i++) {
+        if (directTargets[i] && !options.blockFunctions) {
+            registerSSA.sealBlock(instructionLabels[i]);
+        }
+    }
+
+    // Adding this here to avoid putting a terminating block in the middle of a program
+    finishProgram();
+    foldEmptyLandingBlocks();
+    if (options.telemetry) {
+        options.telemetry->addTime(PHASE_BUILD, CompileTelemetry::since(buildStart));
+    }
+
+    return std::move(module);
+}
+
+std::unique_ptr<llvm::Module> Compiler::buildMainModule()
+{
+    auto mainModule = std::make_unique<llvm::Module>("um_main", context);
+    mainModule->setTargetTriple(targetTriple);
+    mainModule->setDataLayout(dataLayout);
+
+    llvm::Type* i32 = llvm::Type::getInt32Ty(context);
+    llvm::PointerType* ptr = llvm::PointerType::getUnqual(context);
+    llvm::FunctionType* funcType = llvm::FunctionType::get(i32, {ptr}, false);
+
+    // Table of region entry points; each resolves to a lazy call-through stub
+    std::vector<llvm::Constant*> entries;
+    for (size_t region = 0; region < numRegions(); region++) {
+        entries.push_back(llvm::Function::Create(
+            funcType,
+            llvm::Function::ExternalLinkage,
+            "um_region_" + std::to_string(region),
+            mainModule.get()
+        ));
+    }
+    llvm::ArrayType* tableType = llvm::ArrayType::get(ptr, entries.size());
+    llvm::GlobalVariable* regionTable = new llvm::GlobalVariable(
+        *mainModule,
+        tableType,
+        true,
+        llvm::GlobalValue::PrivateLinkage,
+        llvm::ConstantArray::get(tableType, entries),
+        "region_table"
+    );
+
+    llvm::Function* mainFunc = llvm::Function::Create(
+        funcType,
+        llvm::Function::ExternalLinkage,
+        "main",
+        mainModule.get()
+    );
+    llvm::Value* state = mainFunc->getArg(0);
+    state->setName("state");
+
+    llvm::BasicBlock* entryBlock = llvm::BasicBlock::Create(context, "entry", mainFunc);
+    llvm::BasicBlock* loopBlock = llvm::BasicBlock::Create(context, "loop", mainFunc);
+    llvm::BasicBlock* callBlock = llvm::BasicBlock::Create(context, "call_region", mainFunc);
+    llvm::BasicBlock* doneBlock = llvm::BasicBlock::Create(context, "done", mainFunc);
+    llvm::BasicBlock* outBlock = llvm::BasicBlock::Create(context, "out_of_range", mainFunc);
+
+    llvm::IRBuilder<> mainBuilder(entryBlock);
+    mainBuilder.CreateBr(loopBlock);
+
+    // Keep calling regions until one of them halts or needs the driver
+    mainBuilder.SetInsertPoint(loopBlock);
+    llvm::Value* pcPtr = mainBuilder.CreateConstInBoundsGEP1_32(i32, state, 8, "state_pc");
+    llvm::LoadInst* pc = mainBuilder.CreateLoad(i32, pcPtr, "pc");
+    memoryTags.tag(pc, UM_MEMORY_PC);
+    llvm::Value* inRange = mainBuilder.CreateICmpULT(
+        pc,
+        mainBuilder.getInt32(program.size()),
+        "in_range"
+    );
+    mainBuilder.CreateCondBr(inRange, callBlock, outBlock);
+
+    mainBuilder.SetInsertPoint(callBlock);
+    llvm::Value* region = mainBuilder.CreateLShr(pc, REGION_SHIFT, "region");
+    llvm::Value* slot = mainBuilder.CreateInBoundsGEP(
+        tableType,
+        regionTable,
+        {mainBuilder.getInt64(0), mainBuilder.CreateZExt(region, mainBuilder.getInt64Ty())},
+        "region_slot"
+    );
+    llvm::Value* regionFunc = mainBuilder.CreateLoad(ptr, slot, "region_func");
+    llvm::Value* result = mainBuilder.CreateCall(funcType, regionFunc, {state}, "result");
+    llvm::Value* isJump = mainBuilder.CreateICmpEQ(
+        result,
+        mainBuilder.getInt32(UM_EXIT_JUMP),
+        "is_jump"
+    );
+    mainBuilder.CreateCondBr(isJump, loopBlock, doneBlock);
+
+    mainBuilder.SetInsertPoint(doneBlock);
+    mainBuilder.CreateRet(result);
+
+    // The driver reports gotos past the end of segment 0
+    mainBuilder.SetInsertPoint(outBlock);
+    mainBuilder.CreateRet(mainBuilder.getInt32(UM_EXIT_MISS));
+
+    return mainModule;
+}
+
+void Compiler::compileInstruction(uint32_t word)
+{
+    // A leader starts a new block; fall into it from the previous run
+    llvm::BasicBlock* label = instructionLabels[currentInstructionIndex - regionStart];
+    if (label && options.blockFunctions) {
+        // Fall into the leader's function, taking the registers along
+        llvm::BasicBlock* current = builder.GetInsertBlock();
+        if (current && !current->getTerminator()) {
+            callBlock(blockFunctions[currentInstructionIndex - regionStart],
+                      blockArguments(), true);
+        }
+        startBlockFunction(currentInstructionIndex - regionStart);
+    } else if (label) {
+        bool direct = directTargets[currentInstructionIndex - regionStart];
+        llvm::BasicBlock* current = builder.GetInsertBlock();
+        if (current && !current->getTerminator()) {
+            builder.CreateBr(label);
+        } else {
+            // Reached only by gotos, which spill everything first
+            dirtyRegisters = 0;
+        }
+        builder.SetInsertPoint(label);
+
+        // Direct gotos do not spill, and some may come later in the
+        // region, so treat every register as written and seal at the end
+        if (direct) {
+            dirtyRegisters = 0xFF;
+        } else {
+            registerSSA.sealBlock(label);
+        }
+    }
+
+    uint32_t opcode = (word >> 28) & 0xF;
+
+    uint32_t a = 0;
+
+    uint32_t b = 0, c = 0;
+
+    c = word & 0x7;
+    b = (word >> 3) & 0x7;
+    a = (word >> 6) & 0x7;
+
+    bool addedTerminator = false;
+
+    switch (opcode) {
+        case 13: {
+            // Load register
+            a = (word >> 25) & 0x7;
+            uint32_t val = word & 0x1FFFFFF;
+            setRegisterValues(a, val);
+            break;
+        }
+
+        case 0: {
+            conditionalMove(a, b, c);
+            break;
+        }
+
+        case 1: {
+            // assert(false);
+            compileLoad(a, b, c);
+            break;
+
+        }
+
+        case 2: {
+            // assert(false);
+            compileStore(a, b, c);
+            break;
+        }
+
+        case 3: {
+            // Adding two numbers
+            compileAddition(a, b, c);
+            break;
+        }
+
+        case 4: {
+            compileMul(a, b, c);
+            break;
+        }
+
+        case 5: {
+            compileDiv(a, b, c);
+            break;
+        }
+
+        case 6: {
+            compileNand(a, b, c);
+            break;
+        }
+
+        case 7: {
+            // Halt instruction
+            if (!haltBlock) {
+                createHaltBlock();
+            }
+            builder.CreateBr(haltBlock);
+            addedTerminator = true;
+            break;
+        }
+
+        case 8: {
+            // Map segment
+            compileMap(b, c);
+            break;
+        }
+
+        case 9: {
+            // Unmap segment
+            compileUnmap(c);
+            break;
+        }
+
+        case 10: {
+            // add some IR to print out a particular register.
+            printRegister(c);
+            break;
+        }
+
+        case 11: {
+            readIntoRegister(c);
+            break;
+        }
+
+        case 12: {
+            // load program
+            // std::cerr << "Trying to load program\n";
+            // assert(false);
+            compileLoadProgram(b, c);
+            addedTerminator = true;  // jumpToDispatch adds the terminator
+            break;
+        }
+
+    }
+
+    // Halt and load program always end a run, so the next word is a leader
+    assert(!addedTerminator || currentInstructionIndex + 1 == program.size()
+           || leaders.isLeader(currentInstructionIndex + 1));
+    (void)addedTerminator;
+
+    currentInstructionIndex++;
+}
+
+// Original
+void Compiler::compileLoadProgram(int regB, int regC) {
+    llvm::Value* segmentId = readRegister(regB, "load_program_segment");
+
+    // Load the target instruction index from register C
+    llvm::Value* targetIndex = readRegister(regC, "load_target_index");
+
+    if (!reloadBlock) {
+        reloadBlock = createExitBlock("reload", UM_EXIT_RELOAD);
+    }
+
+    // Jumping within segment 0 stays in compiled code. Any other segment
+    // replaces the program, which has to be recompiled by the driver.
+    llvm::BasicBlock* gotoBlock = llvm::BasicBlock::Create(
+        context,
+        "goto",
+        currentFunction
+    );
+    llvm::BasicBlock* replaceBlock = llvm::BasicBlock::Create(
+        context,
+        "replace_program",
+        currentFunction
+    );
+    TargetCounts counts;
+    llvm::MDNode* weights = nullptr;
+    if (currentProfile) {
+        auto site = currentProfile->gotos.find(currentInstructionIndex);
+        if (site != currentProfile->gotos.end()) {
+            counts = site->second;
+        }
+        auto reloads = currentProfile->reloads.find(currentInstructionIndex);
+
+        uint64_t gotos = 0;
+        for (auto& [target, count] : counts) {
+            gotos += count;
+        }
+        weights = branchWeights({
+            gotos,
+            reloads != currentProfile->reloads.end() ? reloads->second : 0
+        });
+    }
+
+    llvm::Value* zero = llvm::ConstantInt::get(llvm::Type::getInt32Ty(context), 0);
+    llvm::Value* isJump = builder.CreateICmpEQ(segmentId, zero, "is_jump");
+    builder.CreateCondBr(isJump, gotoBlock, replaceBlock, weights);
+    registerSSA.sealBlock(gotoBlock);
+    registerSSA.sealBlock(replaceBlock);
+
+    // Store the target as the next instruction to execute
+    builder.SetInsertPoint(replaceBlock);
+    memoryTags.tag(builder.CreateStore(targetIndex, pcPointer()), UM_MEMORY_PC);
+    spillRegisters();
+    builder.CreateCall(loadProgramFunc, {segmentId});
+    builder.CreateBr(reloadBlock);
+
+    builder.SetInsertPoint(gotoBlock);
+    if (jumpDirect(targetIndex, counts)) {
+        return;
+    }
+    memoryTags.tag(builder.CreateStore(targetIndex, pcPointer()), UM_MEMORY_PC);
+    // Block functions pass the registers along, and only spill on the way
+    // out of the region
+    if (!options.blockFunctions) {
+        spillRegisters();
+    }
+    promoteHotTargets(targetIndex, counts);
+    jumpToDispatch(targetIndex, currentProfile ? &counts : nullptr);
+}
+
+bool Compiler::jumpDirect(llvm::Value* index, TargetCounts& counts)
+{
+    const std::vector<uint32_t>& targets = gotoTargets[currentInstructionIndex - regionStart];
+    if (targets.empty()) {
+        return false;
+    }
+
+    // A move between two targets becomes a plain branch, which loop
+    // passes can compute trip counts from
+    auto* select = llvm::dyn_cast<llvm::SelectInst>(index);
+    if (select && targets.size() == 2) {
+        auto* taken = llvm::dyn_cast<llvm::ConstantInt>(select->getTrueValue());
+        auto* other = llvm::dyn_cast<llvm::ConstantInt>(select->getFalseValue());
+        if (taken && other && taken != other
+            && std::count(targets.begin(), targets.end(), taken->getZExtValue())
+            && std::count(targets.begin(), targets.end(), other->getZExtValue())) {
+            std::vector<uint64_t> weights = {0, 0};
+            for (int i = 0; i < 2; i++) {
+                auto count = counts.find(i == 0 ? taken->getZExtValue() : other->getZExtValue());
+                if (count != counts.end()) {
+                    weights[i] = count->second;
+                }
+            }
+            builder.CreateCondBr(
+                select->getCondition(),
+                enterLeader(taken->getZExtValue(), true),
+                enterLeader(other->getZExtValue(), true),
+                currentProfile ? branchWeights(weights) : nullptr
+            );
+            return true;
+        }
+    }
+
+    // Anything else, which the scan says cannot happen, goes to dispatch
+    llvm::BasicBlock* otherBlock = llvm::BasicBlock::Create(
+        context,
+        "goto_other",
+        currentFunction
     );
+    llvm::SwitchInst* jump = builder.CreateSwitch(index, otherBlock, targets.size());
+    std::vector<uint64_t> weights = {0};
+    for (uint32_t target : targets) {
+        jump->addCase(builder.getInt32(target), enterLeader(target, true));
+        auto count = counts.find(target);
+        weights.push_back(count != counts.end() ? count->second : 0);
+        counts.erase(target);
+    }
+    if (currentProfile) {
+        jump->setMetadata(llvm::LLVMContext::MD_prof, branchWeights(weights));
+    }
+
+    registerSSA.sealBlock(otherBlock);
+    builder.SetInsertPoint(otherBlock);
+    return false;
+}
+
+/* Gotos that nearly always land on the same leader branch there directly,
+ * leaving the indirectbr for the rest. Taken targets are removed from counts. */
+void Compiler::promoteHotTargets(llvm::Value* index, TargetCounts& counts)
+{
+    uint64_t total = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> candidates;
+    for (auto& [target, count] : counts) {
+        total += count;
+        size_t local = target - regionStart;
+        if (target >= regionStart && local < landingBlocks.size() && landingBlocks[local]) {
+            candidates.push_back({count, target});
+        }
+    }
+    std::sort(candidates.rbegin(), candidates.rend());
+
+    uint64_t remaining = total;
+    for (size_t i = 0; i < candidates.size() && i < MAX_PROMOTED_TARGETS; i++) {
+        auto [count, target] = candidates[i];
+        if ((uint64_t)count * 4 < total) {
+            break;
+        }
+
+        llvm::BasicBlock* otherBlock = llvm::BasicBlock::Create(
+            context,
+            "goto_other",
+            currentFunction
+        );
+        llvm::Value* isHot = builder.CreateICmpEQ(index, builder.getInt32(target), "is_hot_target");
+        remaining -= count;
+        builder.CreateCondBr(
+            isHot,
+            enterLeader(target, false),
+            otherBlock,
+            branchWeights({count, remaining})
+        );
+        registerSSA.sealBlock(otherBlock);
+        builder.SetInsertPoint(otherBlock);
+        counts.erase(target);
+    }
+}
+
+llvm::MDNode* Compiler::branchWeights(const std::vector<uint64_t>& counts)
+{
+    uint64_t largest = 0;
+    for (uint64_t count : counts) {
+        largest = std::max(largest, count);
+    }
+    if (largest == 0) {
+        return nullptr;
+    }
+
+    // Weights are 32 bits; only their ratios matter
+    uint64_t scale = largest / UINT32_MAX + 1;
+    std::vector<uint32_t> weights;
+    for (uint64_t count : counts) {
+        weights.push_back(count / scale);
+    }
+    return llvm::MDBuilder(context).createBranchWeights(weights);
+}
+
+void Compiler::printRegister(int regC)
+{
+    llvm::Value* charValue = readRegister(regC, "putchar_value");
+
+    // call putchar with register value
+    builder.CreateCall(putcharFunc, {charValue}, "putchar_call");
+}
+
+void Compiler::readIntoRegister(int regC)
+{
+    llvm::Value* inputChar = builder.CreateCall(getcharFunc, {}, "getchar_call");
+
+    writeRegister(regC, inputChar);
+}
+
+void Compiler::compileMap(int regB, int regC)
+{
+    llvm::Value* mapSize = readRegister(regC, "load_map_size");
+
+    // vs_calloc takes a size in bytes, not words
+    llvm::Value* mapBytes = builder.CreateShl(mapSize, 2, "map_bytes");
+
+    llvm::Value* mapResult = builder.CreateCall(vsCallocFunc, {usableMem, mapBytes}, "vs_calloc_call");
+
+    writeRegister(regB, mapResult);
+}
+
+void Compiler::compileUnmap(int regC)
+{
+    llvm::Value *freeAddr = readRegister(regC, "unmap_addr");
 
     // no name for void calls
-    builder.CreateCall(vsFreeFunc, {freeAddr});
+    builder.CreateCall(vsFreeFunc, {usableMem, freeAddr});
 }
 
 // void Compiler::compileLoad(int regA, int regB, int regC)
@@ -746,63 +1870,86 @@ void Compiler::compileUnmap(int regC)
 // }
 
 
-// Fixed pointer arithmetic for load operation
-void Compiler::compileLoad(int regA, int regB, int regC)
+// Segment IDs are byte offsets into the arena: m[B][C] is at B + 4C.
+// An offset of 2^30 or more is past the end of the 4GB arena, so it can
+// only come from a machine failure. Saying so, and doing the arithmetic in
+// 64 bits, lets LLVM prove a loop over a segment never wraps, which is what
+// loop idiom recognition needs to see a fill or copy.
+llvm::Value* Compiler::arenaPointer(llvm::Value* segmentId, llvm::Value* offset)
 {
-    // load segment id from register B
-    llvm::Value* segmentId = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regB],
-        "load_segment_id"
+    llvm::Value* segmentPtr = builder.CreateGEP(
+        llvm::Type::getInt8Ty(context),
+        usableMem,
+        builder.CreateZExt(segmentId, builder.getInt64Ty()),
+        "segment_ptr"
     );
 
-    // load the offset from register C
-    llvm::Value* offset = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regC],
-        "load_offset"
+    // Only the SSA pipeline runs the loop passes that read it
+    if (options.ssaRegisters && !llvm::isa<llvm::ConstantInt>(offset)) {
+        builder.CreateAssumption(
+            builder.CreateICmpULT(offset, builder.getInt32(1u << 30), "offset_in_arena")
+        );
+    }
+    llvm::Value* byteOffset = builder.CreateShl(
+        builder.CreateZExt(offset, builder.getInt64Ty()),
+        2,
+        "byte_offset",
+        true,
+        true
     );
 
-    // load usable memory base address
-    llvm::Value* usableMemBase = builder.CreateLoad(
-        llvm::PointerType::getUnqual(context),
-        usableMemPtr,
-        "usable_mem_base"
+    return builder.CreateGEP(
+        llvm::Type::getInt8Ty(context),
+        segmentPtr,
+        byteOffset,
+        "final_ptr"
     );
+}
 
-    // Cast to int32 pointer for proper arithmetic
-    llvm::Value* int32BasePtr = builder.CreatePointerCast(
-        usableMemBase,
-        llvm::PointerType::get(llvm::Type::getInt32Ty(context), 0),
-        "int32_base_ptr"
-    );
+// Fixed pointer arithmetic for load operation
+void Compiler::compileLoad(int regA, int regB, int regC)
+{
+    // load segment id from register B
+    llvm::Value* segmentId = readRegister(regB, "load_segment_id");
 
-    // Calculate segment address (segment_id * some_segment_size)
-    // Assuming segments are stored as consecutive blocks
-    llvm::Value* segmentPtr = builder.CreateGEP(
-        llvm::Type::getInt32Ty(context),
-        int32BasePtr,
-        segmentId,
-        "segment_ptr"
-    );
+    // load the offset from register C
+    llvm::Value* offset = readRegister(regC, "load_offset");
+
+    // Reads of an unchanging segment 0 come from the program itself
+    auto* constantSegment = llvm::dyn_cast<llvm::ConstantInt>(segmentId);
+    if (segmentZeroConstant && constantSegment && constantSegment->isZero()) {
+        auto* constantOffset = llvm::dyn_cast<llvm::ConstantInt>(offset);
+        if (constantOffset && constantOffset->getZExtValue() < program.size()) {
+            writeRegister(regA, builder.getInt32(program[constantOffset->getZExtValue()]));
+            return;
+        }
 
-    // Add the offset (now in terms of int32 elements)
-    llvm::Value* finalPtr = builder.CreateGEP(
-        llvm::Type::getInt32Ty(context),
-        segmentPtr,
-        offset,
-        "final_ptr"
-    );
+        llvm::Value* imagePtr = builder.CreateGEP(
+            segmentZeroImage()->getValueType(),
+            segmentZeroImage(),
+            {builder.getInt64(0), builder.CreateZExt(offset, builder.getInt64Ty())},
+            "segment_zero_ptr"
+        );
+        llvm::LoadInst* word = builder.CreateLoad(
+            llvm::Type::getInt32Ty(context),
+            imagePtr,
+            "segment_zero_value"
+        );
+        memoryTags.tag(word, UM_MEMORY_SEGMENT_ZERO);
+        writeRegister(regA, word);
+        return;
+    }
 
     // Load the 32-bit value
-    llvm::Value* loadedValue = builder.CreateLoad(
+    llvm::LoadInst* loadedValue = builder.CreateLoad(
         llvm::Type::getInt32Ty(context),
-        finalPtr,
+        arenaPointer(segmentId, offset),
         "loaded_value"
     );
+    memoryTags.tag(loadedValue, UM_MEMORY_ARENA);
 
     // Store result in register A
-    builder.CreateStore(loadedValue, registers[regA]);
+    writeRegister(regA, loadedValue);
 }
 
 
@@ -829,154 +1976,530 @@ void Compiler::compileLoad(int regA, int regB, int regC)
 //         "value_to_store"
 //     );
 
-//     llvm::Value* usableMemBase = builder.CreateLoad(
-//         llvm::PointerType::getUnqual(context),
-//         usableMemPtr,
-//         "usable_mem_base"
-//     );
+//     llvm::Value* usableMemBase = builder.CreateLoad(
+//         llvm::PointerType::getUnqual(context),
+//         usableMemPtr,
+//         "usable_mem_base"
+//     );
+
+//     llvm::Value* segmentPtr = builder.CreateGEP(
+//         llvm::Type::getInt8Ty(context),
+//         usableMemBase,
+//         segmentId,
+//         "segment_ptr"
+//     );
+
+//     llvm::Value* finalPtr = builder.CreateGEP(
+//         llvm::Type::getInt8Ty(context),
+//         segmentPtr,
+//         offset,
+//         "final_ptr"
+//     );
+
+//     builder.CreateStore(valueToStore, finalPtr);
+// }
+
+
+// Fixed pointer arithmetic for store operation
+void Compiler::compileStore(int regA, int regB, int regC)
+{
+    // load segmentID from register A
+    llvm::Value* segmentId = readRegister(regA, "store_segment_id");
+
+    // load offset from register B
+    llvm::Value* offset = readRegister(regB, "store_offset");
+
+    // load the value to store from register C
+    llvm::Value* valueToStore = readRegister(regC, "value_to_store");
+
+    // Store the value
+    memoryTags.tag(
+        builder.CreateStore(valueToStore, arenaPointer(segmentId, offset)),
+        UM_MEMORY_ARENA
+    );
+
+    if (!segmentZeroConstant) {
+        return;
+    }
+
+    // Write barrier: the first store into segment 0 makes everything
+    // compiled against it stale, so go back to the driver to recompile
+    auto* constantSegment = llvm::dyn_cast<llvm::ConstantInt>(segmentId);
+    if (constantSegment && !constantSegment->isZero()) {
+        return;
+    }
+
+    if (!reloadBlock) {
+        reloadBlock = createExitBlock("reload", UM_EXIT_RELOAD);
+    }
+    llvm::BasicBlock* barrierBlock = llvm::BasicBlock::Create(
+        context,
+        "segment_zero_written",
+        currentFunction
+    );
+    llvm::BasicBlock* continueBlock = llvm::BasicBlock::Create(
+        context,
+        "store_done",
+        currentFunction
+    );
+    llvm::Value* isSegmentZero = builder.CreateICmpEQ(
+        segmentId,
+        builder.getInt32(0),
+        "is_segment_zero"
+    );
+    builder.CreateCondBr(
+        isSegmentZero,
+        barrierBlock,
+        continueBlock,
+        llvm::MDBuilder(context).createBranchWeights(1, 1000)
+    );
+    registerSSA.sealBlock(barrierBlock);
+    registerSSA.sealBlock(continueBlock);
+
+    builder.SetInsertPoint(barrierBlock);
+    builder.CreateStore(builder.getInt32(1), segmentZeroWrittenPtr);
+    memoryTags.tag(
+        builder.CreateStore(builder.getInt32(currentInstructionIndex + 1), pcPointer()),
+        UM_MEMORY_PC
+    );
+    spillRegisters();
+    builder.CreateBr(reloadBlock);
+
+    builder.SetInsertPoint(continueBlock);
+}
+
+llvm::GlobalVariable* Compiler::segmentZeroImage()
+{
+    // Declared constant so LLVM may hoist and fold loads through it. The
+    // words are the Compiler's copy of the program, bound to this name in
+    // addProgram.
+    if (!segmentZeroGlobal) {
+        segmentZeroGlobal = new llvm::GlobalVariable(
+            *module,
+            llvm::ArrayType::get(llvm::Type::getInt32Ty(context), program.size()),
+            true,
+            llvm::GlobalValue::ExternalLinkage,
+            nullptr,
+            "um_segment_zero"
+        );
+    }
+    return segmentZeroGlobal;
+}
+
+void Compiler::jumpToDispatch(llvm::Value* index, const TargetCounts* counts) {
+    // Each goto gets its own indirectbr so the branch predictor keeps a
+    // separate history per site, unless that would blow up the edge count
+    if (replicateDispatch) {
+        if (!index) {
+            llvm::LoadInst* pc = builder.CreateLoad(
+                llvm::Type::getInt32Ty(context),
+                pcPointer(),
+                "next_instr_index"
+            );
+            memoryTags.tag(pc, UM_MEMORY_PC);
+            index = pc;
+        }
+        if (options.blockFunctions) {
+            emitBlockDispatch(index, counts);
+        } else {
+            emitDispatch(index, counts);
+        }
+        return;
+    }
+
+    if (!dispatchBlock) {
+        createDispatchBlock();
+    }
+    builder.CreateBr(dispatchBlock);
+}
+
+//response B:
+void Compiler::createDispatchBlock() {
+    dispatchBlock = llvm::BasicBlock::Create(
+        context, 
+        "dispatch", 
+        currentFunction
+    );
+    
+    // Save current insert point
+    auto savedBlock = builder.GetInsertBlock();
+    auto savedPoint = builder.GetInsertPoint();
+    
+    // Set insert point to dispatch block
+    builder.SetInsertPoint(dispatchBlock);
+    
+    // Load the next instruction index
+    llvm::LoadInst* index = builder.CreateLoad(
+        llvm::Type::getInt32Ty(context),
+        pcPointer(),
+        "next_instr_index"
+    );
+    memoryTags.tag(index, UM_MEMORY_PC);
+
+    // Shared by every site, so weigh leaders by all entries into them
+    emitDispatch(index, currentProfile ? &currentProfile->entries : nullptr);
+    
+    // Restore insert point
+    builder.SetInsertPoint(savedBlock, savedPoint);
+}
+
+void Compiler::createDispatchTable() {
+    if (!missBlock) {
+        missBlock = createExitBlock("miss", UM_EXIT_MISS);
+    }
+    if (!leaveBlock) {
+        leaveBlock = createExitBlock("leave", UM_EXIT_JUMP);
+    }
+
+    // One blockaddress per UM word in the region. Anything that is not a leader goes back
+    // to the driver, which recompiles with the target as a leader.
+    std::vector<llvm::Constant*> entries;
+    if (options.blockFunctions) {
+        // Or with block functions, the leader's function, null if none
+        llvm::PointerType* ptr = llvm::PointerType::getUnqual(context);
+        entries.assign(blockFunctions.size(), llvm::ConstantPointerNull::get(ptr));
+        for (size_t i = 0; i < blockFunctions.size(); i++) {
+            if (blockFunctions[i]) {
+                entries[i] = blockFunctions[i];
+            }
+        }
+    } else {
+        llvm::BlockAddress* missAddress = llvm::BlockAddress::get(currentFunction, missBlock);
+        entries.assign(landingBlocks.size(), missAddress);
+        for (size_t i = 0; i < landingBlocks.size(); i++) {
+            if (landingBlocks[i]) {
+                entries[i] = llvm::BlockAddress::get(currentFunction, landingBlocks[i]);
+            }
+        }
+    }
+
+    llvm::ArrayType* tableType = llvm::ArrayType::get(
+        llvm::PointerType::getUnqual(context),
+        entries.size()
+    );
+    dispatchTable = new llvm::GlobalVariable(
+        *module,
+        tableType,
+        true,
+        llvm::GlobalValue::PrivateLinkage,
+        llvm::ConstantArray::get(tableType, entries),
+        "dispatch_table"
+    );
+
+    // Count goto sites to decide whether every site can have its own copy
+    size_t gotoSites = 0;
+    size_t regionLeaders = 0;
+    for (size_t i = 0; i < instructionLabels.size(); i++) {
+        if (((program[regionStart + i] >> 28) & 0xF) == 12) {
+            gotoSites++;
+        }
+        if (instructionLabels[i]) {
+            regionLeaders++;
+        }
+    }
+    numRegionLeaders = regionLeaders;
+    // Calls through the table add no edges, however many sites there are
+    replicateDispatch = options.blockFunctions
+        || (gotoSites + 1) * (regionLeaders + 1) <= MAX_DISPATCH_EDGES;
+}
+
+void Compiler::emitDispatch(llvm::Value* index, const TargetCounts* counts) {
+    llvm::BasicBlock* lookupBlock = llvm::BasicBlock::Create(
+        context,
+        "dispatch_lookup",
+        currentFunction
+    );
+
+    // Targets outside this region go back to the main loop
+    llvm::Value* localIndex = builder.CreateSub(
+        index,
+        builder.getInt32(regionStart),
+        "region_index"
+    );
+    llvm::Value* numWords = llvm::ConstantInt::get(
+        llvm::Type::getInt32Ty(context),
+        instructionLabels.size()
+    );
+    llvm::Value* inRange = builder.CreateICmpULT(localIndex, numWords, "in_region");
+
+    // Weigh each destination by how often the profile saw it taken
+    std::vector<uint64_t> landingCounts(instructionLabels.size(), 0);
+    uint64_t inside = 0;
+    uint64_t outside = 0;
+    if (counts) {
+        for (auto& [target, count] : *counts) {
+            size_t local = target - regionStart;
+            if (target >= regionStart && local < landingCounts.size()) {
+                landingCounts[local] += count;
+                inside += count;
+            } else {
+                outside += count;
+            }
+        }
+    }
+    builder.CreateCondBr(inRange, lookupBlock, leaveBlock, branchWeights({inside, outside}));
+
+    builder.SetInsertPoint(lookupBlock);
+    llvm::Value* slot = builder.CreateInBoundsGEP(
+        dispatchTable->getValueType(),
+        dispatchTable,
+        {builder.getInt64(0), builder.CreateZExt(localIndex, builder.getInt64Ty())},
+        "dispatch_slot"
+    );
+    llvm::Value* target = builder.CreateLoad(
+        llvm::PointerType::getUnqual(context),
+        slot,
+        "dispatch_target"
+    );
+
+    llvm::IndirectBrInst* jump = builder.CreateIndirectBr(target, numRegionLeaders + 1);
+    std::vector<uint64_t> weights;
+    uint64_t misses = 0;
+    for (size_t i = 0; i < landingBlocks.size(); i++) {
+        if (landingBlocks[i]) {
+            jump->addDestination(landingBlocks[i]);
+            weights.push_back(landingCounts[i]);
+        } else {
+            misses += landingCounts[i];
+        }
+    }
+    jump->addDestination(missBlock);
+    weights.push_back(misses);
+
+    if (counts) {
+        jump->setMetadata(llvm::LLVMContext::MD_prof, branchWeights(weights));
+    }
+}
+
+llvm::FunctionType* Compiler::blockFunctionType()
+{
+    // The state, then the eight registers, which the GHC convention keeps
+    // in host registers across every call
+    llvm::Type* i32 = llvm::Type::getInt32Ty(context);
+    return llvm::FunctionType::get(
+        i32,
+        {llvm::PointerType::getUnqual(context), i32, i32, i32, i32, i32, i32, i32, i32},
+        false
+    );
+}
+
+void Compiler::startBlockFunction(size_t local)
+{
+    currentFunction = blockFunctions[local];
+    llvm::BasicBlock* label = instructionLabels[local];
+    llvm::BasicBlock* entryBlock = llvm::BasicBlock::Create(
+        context,
+        "entry",
+        currentFunction,
+        label
+    );
+    builder.SetInsertPoint(entryBlock);
+
+    statePtr = currentFunction->getArg(0);
+    statePtr->setName("state");
+    addressState();
+    for (int reg = 0; reg < 8; reg++) {
+        llvm::Argument* value = currentFunction->getArg(reg + 1);
+        value->setName("reg" + std::to_string(reg));
+        registerSSA.writeVariable(reg, entryBlock, value);
+    }
+    registerSSA.sealBlock(entryBlock);
+    builder.CreateBr(label);
+
+    // Exit blocks belong to the function that branches to them
+    dispatchBlock = nullptr;
+    haltBlock = nullptr;
+    reloadBlock = nullptr;
+    missBlock = createExitBlock("miss", UM_EXIT_MISS);
+    leaveBlock = createExitBlock("leave", UM_EXIT_JUMP);
 
-//     llvm::Value* segmentPtr = builder.CreateGEP(
-//         llvm::Type::getInt8Ty(context),
-//         usableMemBase,
-//         segmentId,
-//         "segment_ptr"
-//     );
+    builder.SetInsertPoint(label);
+    registerSSA.sealBlock(label);
 
-//     llvm::Value* finalPtr = builder.CreateGEP(
-//         llvm::Type::getInt8Ty(context),
-//         segmentPtr,
-//         offset,
-//         "final_ptr"
-//     );
+    // Only the arguments hold the registers, so any exit has to spill them
+    dirtyRegisters = 0xFF;
+}
 
-//     builder.CreateStore(valueToStore, finalPtr);
-// }
+std::vector<llvm::Value*> Compiler::blockArguments()
+{
+    std::vector<llvm::Value*> arguments = {statePtr};
+    for (int reg = 0; reg < 8; reg++) {
+        arguments.push_back(readRegister(reg, ""));
+    }
+    return arguments;
+}
 
+void Compiler::callBlock(llvm::Value* callee, const std::vector<llvm::Value*>& arguments,
+                         bool tail)
+{
+    llvm::CallInst* call = builder.CreateCall(blockFunctionType(), callee, arguments);
+    call->setCallingConv(llvm::CallingConv::GHC);
+    if (tail) {
+        call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+    }
+    builder.CreateRet(call);
+}
 
-// Fixed pointer arithmetic for store operation
-void Compiler::compileStore(int regA, int regB, int regC)
+llvm::BasicBlock* Compiler::enterLeader(uint32_t target, bool direct)
 {
-    // load segmentID from register A
-    llvm::Value* segmentId = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regA],
-        "store_segment_id"
-    );
+    size_t local = target - regionStart;
+    if (!options.blockFunctions) {
+        return direct ? instructionLabels[local] : landingBlocks[local];
+    }
 
-    // load offset from register B
-    llvm::Value* offset = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regB],
-        "store_offset"
+    // Only the current block branches here, so the registers are as they
+    // are there
+    std::vector<llvm::Value*> arguments = blockArguments();
+    llvm::BasicBlock* enterBlock = llvm::BasicBlock::Create(
+        context,
+        "enter_" + std::to_string(target),
+        currentFunction
     );
+    auto savedBlock = builder.GetInsertBlock();
+    auto savedPoint = builder.GetInsertPoint();
 
-    // load the value to store from register C
-    llvm::Value* valueToStore = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[regC],
-        "value_to_store"
-    );
+    builder.SetInsertPoint(enterBlock);
+    callBlock(blockFunctions[local], arguments, true);
 
-    // load usable memory base address
-    llvm::Value* usableMemBase = builder.CreateLoad(
-        llvm::PointerType::getUnqual(context),
-        usableMemPtr,
-        "usable_mem_base"
-    );
+    builder.SetInsertPoint(savedBlock, savedPoint);
+    return enterBlock;
+}
 
-    // Cast to int32 pointer for proper arithmetic
-    llvm::Value* int32BasePtr = builder.CreatePointerCast(
-        usableMemBase,
-        llvm::PointerType::get(llvm::Type::getInt32Ty(context), 0),
-        "int32_base_ptr"
-    );
+void Compiler::emitBlockDispatch(llvm::Value* index, const TargetCounts* counts)
+{
+    // The region function is called by the driver in the C convention, so
+    // only calls between block functions can be tail calls
+    bool tail = currentFunction->getCallingConv() == llvm::CallingConv::GHC;
 
-    // Calculate segment address
-    llvm::Value* segmentPtr = builder.CreateGEP(
-        llvm::Type::getInt32Ty(context),
-        int32BasePtr,
-        segmentId,
-        "segment_ptr"
+    llvm::BasicBlock* lookupBlock = llvm::BasicBlock::Create(
+        context,
+        "dispatch_lookup",
+        currentFunction
     );
-
-    // Add the offset
-    llvm::Value* finalPtr = builder.CreateGEP(
-        llvm::Type::getInt32Ty(context),
-        segmentPtr,
-        offset,
-        "final_ptr"
+    llvm::BasicBlock* callBlockTarget = llvm::BasicBlock::Create(
+        context,
+        "dispatch_call",
+        currentFunction
+    );
+    llvm::BasicBlock* outBlock = llvm::BasicBlock::Create(
+        context,
+        "dispatch_leave",
+        currentFunction
+    );
+    llvm::BasicBlock* unknownBlock = llvm::BasicBlock::Create(
+        context,
+        "dispatch_miss",
+        currentFunction
     );
 
-    // Store the value
-    builder.CreateStore(valueToStore, finalPtr);
+    // Targets outside this region go back to the main loop
+    llvm::Value* localIndex = builder.CreateSub(
+        index,
+        builder.getInt32(regionStart),
+        "region_index"
+    );
+    llvm::Value* numWords = builder.getInt32(blockFunctions.size());
+    llvm::Value* inRange = builder.CreateICmpULT(localIndex, numWords, "in_region");
+
+    uint64_t inside = 0;
+    uint64_t outside = 0;
+    if (counts) {
+        for (auto& [target, count] : *counts) {
+            if (target >= regionStart && target - regionStart < blockFunctions.size()) {
+                inside += count;
+            } else {
+                outside += count;
+            }
+        }
+    }
+    builder.CreateCondBr(inRange, lookupBlock, outBlock, branchWeights({inside, outside}));
+    registerSSA.sealBlock(lookupBlock);
+    registerSSA.sealBlock(outBlock);
+
+    builder.SetInsertPoint(lookupBlock);
+    llvm::Value* slot = builder.CreateInBoundsGEP(
+        dispatchTable->getValueType(),
+        dispatchTable,
+        {builder.getInt64(0), builder.CreateZExt(localIndex, builder.getInt64Ty())},
+        "dispatch_slot"
+    );
+    llvm::Value* target = builder.CreateLoad(
+        llvm::PointerType::getUnqual(context),
+        slot,
+        "dispatch_target"
+    );
+    llvm::Value* isLeader = builder.CreateIsNotNull(target, "is_leader");
+    builder.CreateCondBr(isLeader, callBlockTarget, unknownBlock);
+    registerSSA.sealBlock(callBlockTarget);
+    registerSSA.sealBlock(unknownBlock);
+
+    builder.SetInsertPoint(callBlockTarget);
+    callBlock(target, blockArguments(), tail);
+
+    // The pc is already stored, and the registers go with it
+    builder.SetInsertPoint(outBlock);
+    spillRegisters();
+    builder.CreateBr(leaveBlock);
+
+    builder.SetInsertPoint(unknownBlock);
+    spillRegisters();
+    builder.CreateBr(missBlock);
 }
 
-void Compiler::jumpToDispatch() {
-    if (!dispatchBlock) {
-        createDispatchBlock();
-    }
-    builder.CreateBr(dispatchBlock);
+llvm::Value* Compiler::statePointer(unsigned slot)
+{
+    return stateSlots[slot];
 }
 
-//response B:
-void Compiler::createDispatchBlock() {
-    dispatchBlock = llvm::BasicBlock::Create(
-        context, 
-        "dispatch", 
+llvm::BasicBlock* Compiler::createExitBlock(const std::string& name, UMExit code)
+{
+    llvm::BasicBlock* exitBlock = llvm::BasicBlock::Create(
+        context,
+        name,
         currentFunction
     );
-    
-    // Save current insert point
+
     auto savedBlock = builder.GetInsertBlock();
     auto savedPoint = builder.GetInsertPoint();
-    
-    // Set insert point to dispatch block
-    builder.SetInsertPoint(dispatchBlock);
-    
-    // Load the next instruction index
-    llvm::Value* index = builder.CreateLoad(
+
+    builder.SetInsertPoint(exitBlock);
+
+    // SSA code spills to the state before branching here
+    if (options.ssaRegisters) {
+        builder.CreateRet(llvm::ConstantInt::get(llvm::Type::getInt32Ty(context), code));
+        builder.SetInsertPoint(savedBlock, savedPoint);
+        return exitBlock;
+    }
+
+    // Write the registers and the pending instruction back to the state
+    for (int i = 0; i < 8; i++) {
+        llvm::LoadInst* value = builder.CreateLoad(
+            llvm::Type::getInt32Ty(context),
+            registers[i],
+            "exit_reg" + std::to_string(i)
+        );
+        memoryTags.tag(value, UM_MEMORY_REGISTERS);
+        memoryTags.tag(builder.CreateStore(value, statePointer(i)), UM_MEMORY_REGISTERS);
+    }
+
+    llvm::LoadInst* pc = builder.CreateLoad(
         llvm::Type::getInt32Ty(context),
         nextInstructionPtr,
-        "next_instr_index"
-    );
-    
-    // Create switch instruction (jump table)
-    // Default case will be the first instruction (or you could create an error block)
-    llvm::SwitchInst* jumpTable = builder.CreateSwitch(
-        index, 
-        instructionLabels[0],  // default destination
-        instructionLabels.size()  // number of cases
+        "exit_pc"
     );
-    
-    // Add cases for each instruction
-    for (size_t i = 0; i < instructionLabels.size(); i++) {
-        llvm::ConstantInt* caseValue = llvm::ConstantInt::get(
-            llvm::Type::getInt32Ty(context), 
-            i
-        );
-        jumpTable->addCase(caseValue, instructionLabels[i]);
-    }
-    
-    // Restore insert point
-    builder.SetInsertPoint(savedBlock, savedPoint);
-}
+    memoryTags.tag(pc, UM_MEMORY_PC);
+    memoryTags.tag(builder.CreateStore(pc, statePointer(8)), UM_MEMORY_PC);
 
+    builder.CreateRet(llvm::ConstantInt::get(llvm::Type::getInt32Ty(context), code));
 
+    builder.SetInsertPoint(savedBlock, savedPoint);
+    return exitBlock;
+}
 
 llvm::Error Compiler::executeJIT()
 {
     // runOptimizationPasses();  // <-- dd this line here
 
-    // Verify the module before JIT compilation
-    std::string errorStr;
-    llvm::raw_string_ostream errorStream(errorStr);
-    if (llvm::verifyModule(*module, &errorStream)) {
-        return llvm::make_error<llvm::StringError>(
-            "Module verification failed: " + errorStr,
-            llvm::inconvertibleErrorCode()
-        );
-    }
-    
     // // Create a new context for the ThreadSafeModule
     // auto newContext = std::make_unique<llvm::LLVMContext>();
     
@@ -1032,38 +2555,380 @@ llvm::Error Compiler::executeJIT()
     
     // return llvm::Error::success();
 
-       // Create ThreadSafeModule - let it create its own context
-    // This is the simplest approach that avoids ownership issues
-   // The constructor wants a unique_ptr<LLVMContext>, not ThreadSafeContext
-    auto tsm = llvm::orc::ThreadSafeModule(
-        std::move(module), 
-        std::make_unique<llvm::LLVMContext>()  // Create a new LLVMContext
+    UMState state = {};
+
+    while (true) {
+        if (auto err = addProgram()) {
+            return err;
+        }
+
+        auto mainSymbol = jit->lookup("main");
+        if (!mainSymbol) {
+            return mainSymbol.takeError();
+        }
+
+        auto mainAddr = mainSymbol->getValue();
+        auto mainFunc = reinterpret_cast<uint32_t(*)(UMState*)>(mainAddr);
+
+        uint32_t result = mainFunc(&state);
+
+        if (result == UM_EXIT_HALT) {
+            return llvm::Error::success();
+        }
+
+        // Throw the whole build away; only regions that run get rebuilt
+        if (auto err = discardProgram()) {
+            return err;
+        }
+
+        if (result == UM_EXIT_MISS) {
+            if (state.pc >= program.size()) {
+                return llvm::make_error<llvm::StringError>(
+                    "goto outside of segment 0: " + std::to_string(state.pc),
+                    llvm::inconvertibleErrorCode()
+                );
+            }
+
+            // The dispatcher found a target the static scan missed
+            leaders.addLeader(state.pc);
+        } else {
+            reloadProgram(state);
+        }
+    }
+}
+
+void Compiler::reloadProgram(const UMState& state)
+{
+    // Segment 0 was replaced, so recompile it from the arena
+    uint32_t size = convert_address(usable, 0, uint32_t)[-1];
+    std::vector<uint32_t> words(size / sizeof(uint32_t));
+    for (size_t i = 0; i < words.size(); i++) {
+        words[i] = get_at(usable, i * sizeof(uint32_t));
+    }
+
+    // A store into segment 0 only changed words in place, so every target
+    // a goto was seen to take is still worth a block, and so is the word
+    // after the store, where execution resumes
+    LeaderAnalysis learned = leaders;
+    bool storedInPlace = um_segment_zero_written && words.size() == program.size();
+
+    compileProgram(words, &state);
+
+    if (storedInPlace) {
+        for (size_t i = 0; i < program.size(); i++) {
+            if (learned.isLeader(i)) {
+                leaders.addLeader(i);
+            }
+        }
+        if (state.pc < program.size()) {
+            leaders.addLeader(state.pc);
+        }
+    }
+}
+
+llvm::Error Compiler::discardProgram()
+{
+    if (auto err = mainTracker->remove()) {
+        return err;
+    }
+    return regionTracker->remove();
+}
+
+std::string Compiler::regionSymbol(size_t region) const
+{
+    std::string name = "um_region_" + std::to_string(region) + "_body";
+    if (regionVersions[region] > 0) {
+        name += "_v" + std::to_string(regionVersions[region]);
+    }
+    return name;
+}
+
+llvm::Error Compiler::defineRegion(size_t region)
+{
+    auto body = jit->mangleAndIntern(regionSymbol(region));
+    auto unit = std::make_unique<RegionMaterializationUnit>(*this, region, body);
+    return regionTracker->getJITDylib().define(std::move(unit), regionTracker);
+}
+
+llvm::Error Compiler::redefineRegion(size_t region)
+{
+    // Code for the old version may still be running, so it stays until the
+    // whole program is discarded; the new version gets a name of its own
+    regionVersions[region]++;
+    return defineRegion(region);
+}
+
+llvm::Error Compiler::compileRegions(const std::vector<size_t>& regions,
+                                     const RegionReady& ready)
+{
+    std::mutex doneMutex;
+    std::condition_variable allDone;
+    size_t pending = regions.size();
+    llvm::Error failures = llvm::Error::success();
+
+    // Every lookup is in flight before any is waited for, so with compile
+    // threads the regions build side by side and each is handed over as
+    // soon as it is done
+    for (size_t region : regions) {
+        auto name = jit->mangleAndIntern(regionSymbol(region));
+        jit->getExecutionSession().lookup(
+            llvm::orc::LookupKind::Static,
+            llvm::orc::makeJITDylibSearchOrder(regionDylib),
+            llvm::orc::SymbolLookupSet(name),
+            llvm::orc::SymbolState::Ready,
+            [&, region, name](llvm::Expected<llvm::orc::SymbolMap> compiled) {
+                if (compiled) {
+                    ready(region, (*compiled)[name].getAddress().toPtr<RegionFunction>());
+                }
+                std::lock_guard<std::mutex> lock(doneMutex);
+                if (!compiled) {
+                    failures = llvm::joinErrors(std::move(failures), compiled.takeError());
+                }
+                if (--pending == 0) {
+                    allDone.notify_all();
+                }
+            },
+            llvm::orc::NoDependenciesToRegister
+        );
+    }
+
+    std::unique_lock<std::mutex> lock(doneMutex);
+    allDone.wait(lock, [&] { return pending == 0; });
+    return failures;
+}
+
+llvm::orc::ThreadSafeModule Compiler::takeModule(std::unique_ptr<llvm::Module> built)
+{
+    llvm::orc::ThreadSafeModule shared(std::move(built), tsc);
+    if (options.compileThreads <= 1) {
+        return shared;
+    }
+    return llvm::orc::cloneToNewContext(shared);
+}
+
+void Compiler::addLeader(size_t index)
+{
+    leaders.addLeader(index);
+}
+
+void Compiler::setRegionProfile(size_t region, RegionProfile regionProfile)
+{
+    regionProfiles[region] = std::move(regionProfile);
+}
+
+void Compiler::setProfile(Profile* profile)
+{
+    this->profile = profile;
+}
+
+size_t Compiler::programSize() const
+{
+    return program.size();
+}
+
+unsigned Compiler::compileThreads() const
+{
+    return std::max(options.compileThreads, 1u);
+}
+
+llvm::Error Compiler::addProgram()
+{
+    auto& mainDylib = jit->getMainJITDylib();
+
+    // Track each build so it can be thrown away when we recompile
+    mainTracker = mainDylib.createResourceTracker();
+    regionTracker = regionDylib->createResourceTracker();
+
+    // Stubs from the previous build are unreachable once its code is gone
+    stubsManager = llvm::orc::createLocalIndirectStubsManagerBuilder(
+        jit->getTargetTriple()
+    )();
+
+    llvm::orc::SymbolAliasMap stubs;
+    for (size_t region = 0; region < numRegions(); region++) {
+        auto body = jit->mangleAndIntern(regionSymbol(region));
+        auto stub = jit->mangleAndIntern("um_region_" + std::to_string(region));
+
+        if (auto err = defineRegion(region)) {
+            return err;
+        }
+
+        stubs[stub] = llvm::orc::SymbolAliasMapEntry(
+            body,
+            llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable
+        );
+    }
+
+    auto reexports = llvm::orc::lazyReexports(
+        *callThroughManager,
+        *stubsManager,
+        *regionDylib,
+        std::move(stubs)
     );
-    
-    if (auto err = jit->addIRModule(std::move(tsm))) {
+    if (auto err = mainDylib.define(std::move(reexports), mainTracker)) {
         return err;
     }
-    
-    auto mainSymbol = jit->lookup("main");
-    if (!mainSymbol) {
-        return mainSymbol.takeError();
+
+    // Regions read an unchanging segment 0 straight from our copy
+    auto imageAddr = llvm::orc::ExecutorAddr::fromPtr(program.data());
+    llvm::orc::SymbolMap image;
+    image[jit->mangleAndIntern("um_segment_zero")] = llvm::orc::ExecutorSymbolDef(imageAddr, llvm::JITSymbolFlags::Exported);
+    if (auto err = mainDylib.define(llvm::orc::absoluteSymbols(image), mainTracker)) {
+        return err;
+    }
+
+    auto mainUnit = std::make_unique<MainMaterializationUnit>(
+        *this, jit->mangleAndIntern("main")
+    );
+    return mainDylib.define(std::move(mainUnit), mainTracker);
+}
+
+void Compiler::emitMain(std::unique_ptr<llvm::orc::MaterializationResponsibility> R)
+{
+    std::unique_lock<std::mutex> lock(buildMutex);
+
+    std::string key = mainKey();
+    if (objectCache) {
+        if (auto object = objectCache->lookup(key)) {
+            lock.unlock();
+            if (options.telemetry) {
+                options.telemetry->addCacheHit();
+            }
+            emitTimed([&] {
+                jit->getObjTransformLayer().emit(std::move(R), std::move(object));
+            });
+            return;
+        }
+    }
+
+    auto buildStart = CompileTelemetry::now();
+    auto mainModule = buildMainModule();
+    mainModule->setModuleIdentifier(key);
+    if (options.telemetry) {
+        options.telemetry->addTime(PHASE_BUILD, CompileTelemetry::since(buildStart));
+    }
+
+    std::string errorStr;
+    llvm::raw_string_ostream errorStream(errorStr);
+    if (llvm::verifyModule(*mainModule, &errorStream)) {
+        lock.unlock();
+        jit->getExecutionSession().reportError(llvm::make_error<llvm::StringError>(
+            "Module verification failed: " + errorStr,
+            llvm::inconvertibleErrorCode()
+        ));
+        R->failMaterialization();
+        return;
+    }
+
+    llvm::orc::ThreadSafeModule compiledModule = takeModule(std::move(mainModule));
+    lock.unlock();
+    emitTimed([&] {
+        jit->getIRTransformLayer().emit(std::move(R), std::move(compiledModule));
+    });
+}
+
+void Compiler::emitRegion(std::unique_ptr<llvm::orc::MaterializationResponsibility> R,
+                          size_t region)
+{
+    // Only translation takes the lock; with a context per module, the
+    // pipeline and codegen run outside it
+    std::unique_lock<std::mutex> lock(buildMutex);
+
+    // A warm cache skips translation and codegen altogether
+    std::string key = regionKey(region);
+    if (objectCache) {
+        if (auto object = objectCache->lookup(key)) {
+            lock.unlock();
+            if (options.telemetry) {
+                options.telemetry->addCacheHit();
+            }
+            emitTimed([&] {
+                jit->getObjTransformLayer().emit(std::move(R), std::move(object));
+            });
+            return;
+        }
+    }
+
+    auto regionModule = translateRegion(region);
+    regionModule->setModuleIdentifier(key);
+
+    std::string errorStr;
+    llvm::raw_string_ostream errorStream(errorStr);
+    if (llvm::verifyModule(*regionModule, &errorStream)) {
+        lock.unlock();
+        jit->getExecutionSession().reportError(llvm::make_error<llvm::StringError>(
+            "Module verification failed: " + errorStr,
+            llvm::inconvertibleErrorCode()
+        ));
+        R->failMaterialization();
+        return;
+    }
+
+    // A module of its own context can be optimized outside the lock too
+    bool cloned = options.compileThreads > 1;
+    if (!cloned) {
+        runOptimizationPasses(*regionModule);
+    }
+    llvm::orc::ThreadSafeModule compiledModule = takeModule(std::move(regionModule));
+    lock.unlock();
+    if (cloned) {
+        compiledModule.withModuleDo([&](llvm::Module& clone) {
+            runOptimizationPasses(clone);
+        });
+    }
+    emitTimed([&] {
+        jit->getIRTransformLayer().emit(std::move(R), std::move(compiledModule));
+    });
+}
+
+void Compiler::emitTimed(const std::function<void()>& emit)
+{
+    if (!options.telemetry) {
+        emit();
+        return;
+    }
+
+    // Linking runs from the object transform to the end of the emit, unless
+    // codegen failed and there was nothing to link
+    auto start = std::chrono::steady_clock::now();
+    emit();
+    if (objectReady > start) {
+        options.telemetry->addTime(PHASE_LINK, CompileTelemetry::since(objectReady));
     }
-    
-    auto mainAddr = mainSymbol->getValue();
-    auto mainFunc = reinterpret_cast<int(*)()>(mainAddr);
-    
-    int result = mainFunc();
-    
-    return llvm::Error::success();
 }
 
 void Compiler::jumpToFirstInstruction() {
-    if (!instructionLabels.empty()) {
-        builder.CreateBr(instructionLabels[0]);
+    // Block functions take the registers as arguments, so they come out
+    // of the state here once
+    if (options.blockFunctions) {
+        for (int reg = 0; reg < 8; reg++) {
+            llvm::LoadInst* saved = builder.CreateLoad(
+                llvm::Type::getInt32Ty(context),
+                statePointer(reg),
+                "saved_reg" + std::to_string(reg)
+            );
+            memoryTags.tag(saved, UM_MEMORY_REGISTERS);
+            registerSSA.writeVariable(reg, builder.GetInsertBlock(), saved);
+        }
     }
+
+    // The saved pc is already in place, and so are the registers
+    jumpToDispatch(nullptr, currentProfile ? &currentProfile->entries : nullptr);
 }
 
 void Compiler::finishProgram() {
+    // A run that continues into the next region leaves through the main loop
+    if (currentInstructionIndex < program.size()
+        && !builder.GetInsertBlock()->getTerminator()) {
+        memoryTags.tag(
+            builder.CreateStore(builder.getInt32(currentInstructionIndex), pcPointer()),
+            UM_MEMORY_PC
+        );
+        spillRegisters();
+        builder.CreateBr(leaveBlock);
+        return;
+    }
+
     // response B
     // If we're not already in the halt block, branch to it
     if (builder.GetInsertBlock() != haltBlock) {
@@ -1092,12 +2957,9 @@ void Compiler::createHaltBlock() {
     builder.SetInsertPoint(haltBlock);
 
     // add return instruction
-    llvm::Value* returnValue = builder.CreateLoad(
-        llvm::Type::getInt32Ty(context),
-        registers[0],
-        "return_val"
+    builder.CreateRet(
+        llvm::ConstantInt::get(llvm::Type::getInt32Ty(context), UM_EXIT_HALT)
     );
-    builder.CreateRet(returnValue);
 
     builder.SetInsertPoint(savedBlock, savedPoint);
 }
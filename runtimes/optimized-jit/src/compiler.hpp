@@ -1,5 +1,7 @@
 #pragma once
 #include <cstdint>
+#include <functional>
+#include <mutex>
 #include <vector>
 
 #include "llvm/IR/LLVMContext.h"
@@ -16,22 +18,110 @@
 #include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/Support/Error.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 
+#include "copy_loops.hpp"
+#include "leaders.hpp"
+#include "memory_tags.hpp"
+#include "object_cache.hpp"
+#include "profile.hpp"
+#include "scratch_segments.hpp"
+#include "ssa_builder.hpp"
+#include "telemetry.hpp"
+#include "um_state.hpp"
+#include "virt_ir.hpp"
+
+/* Per-site dispatch copies each carry an edge to every leader. Past this many
+ * edges in total, goto sites share a single dispatch block instead. */
+#define MAX_DISPATCH_EDGES ((size_t)1 << 22)
+
+/* A goto site gets a direct compare for at most this many of its targets,
+ * each of which must have taken at least a quarter of the site's gotos */
+#define MAX_PROMOTED_TARGETS 2
+
+/* A goto whose target register can only hold a few constants branches
+ * straight to those leaders when they are in its region, at most this many */
+#define MAX_DIRECT_TARGETS 4
+
+/* Bump whenever generated code changes shape, so stale cache entries miss */
+#define OBJECT_FORMAT_VERSION 17
+
+struct CompilerOptions {
+    unsigned optLevel = 2;         // 0-3, as with -O
+    std::string cpu;               // Empty tunes for the host CPU
+    std::string features;          // Extra features, as with -mattr
+    bool ssaRegisters = true;      // false keeps registers in allocas
+    std::string cacheDir;          // Empty disables the object cache
+    uint64_t cacheLimit = (uint64_t)512 << 20;
+    unsigned compileThreads = 1;   // Regions compiled at once, each in its own context
+    bool blockFunctions = false;   // Each leader its own function, needs SSA registers
+    CompileTelemetry* telemetry = nullptr;  // Where compile times go, if anywhere
+};
+
+class RegionMaterializationUnit;
+class MainMaterializationUnit;
 
 class Compiler {
+    friend class RegionMaterializationUnit;
+    friend class MainMaterializationUnit;
+
     private:
-        llvm::LLVMContext context;
+        llvm::orc::ThreadSafeContext tsc;
+        llvm::LLVMContext& context;
         std::unique_ptr<llvm::Module> module;
         llvm::IRBuilder<> builder;
+        MemoryTags memoryTags;
         llvm::Function* currentFunction;
         llvm::Value* registers[8];
 
+        // Registers are SSA values unless the alloca path was asked for
+        SSABuilder registerSSA;
+        // Registers written since control last came from the state. Within
+        // a region, fallthrough is the only edge that merges into a leader
+        // without passing through a spill, so one mask per run is exact.
+        uint32_t dirtyRegisters = 0;
+        llvm::Value* readRegister(int reg, const std::string& name);
+        void writeRegister(int reg, llvm::Value* value);
+        void spillRegisters();
+        llvm::Value* pcPointer();
+
         llvm::Function* putcharFunc;
         llvm::Function* getcharFunc;
         llvm::Function* vsCallocFunc;
         llvm::Function* vsFreeFunc;
+        llvm::Function* loadProgramFunc;
+
+        llvm::Value* usableMemPtr = nullptr;  // Global holding the Virt32 arena base
+        llvm::Value* usableMem = nullptr;     // Arena base, loaded once on entry
+        llvm::Value* arenaPointer(llvm::Value* segmentId, llvm::Value* offset);
+        // Addresses the state slots and loads the arena base on entry
+        void addressState();
+        llvm::Value* statePtr = nullptr;      // UMState passed in by the driver
+        llvm::Value* stateSlots[9];           // Addresses of its registers and pc
+
+        // Program currently in segment 0 and the words that start blocks
+        std::vector<uint32_t> program;
+        LeaderAnalysis leaders;
 
-        llvm::Value* usableMemPtr = nullptr;
+        // First word of the region being translated
+        size_t regionStart = 0;
+
+        // Registers no instruction writes, and their values on entry
+        uint32_t constantRegisters = 0;
+        uint32_t entryRegisters[8] = {};
+
+        // Segment 0 has not been written since it was loaded, so loads
+        // from it are program words and stores to it need a barrier
+        bool segmentZeroConstant = false;
+        llvm::GlobalVariable* segmentZeroGlobal = nullptr;
+        llvm::Value* segmentZeroWrittenPtr = nullptr;
+        llvm::GlobalVariable* segmentZeroImage();
+
+        // Times each region was redefined after a miss in tiered execution
+        std::vector<unsigned> regionVersions;
+        std::string regionSymbol(size_t region) const;
+        llvm::Error defineRegion(size_t region);
 
 
         std::vector<llvm::BasicBlock*> instructionBlocks;
@@ -40,18 +130,108 @@ class Compiler {
         size_t currentInstructionIndex = 0;
 
         void setupExternalFunctions();
-        void runOptimizationPasses();
+        void runOptimizationPasses(llvm::Module& target);
 
         
+        // Constant table of blockaddresses, indexed by UM word
+        llvm::GlobalVariable* dispatchTable = nullptr;
+        bool replicateDispatch = true;
+        size_t numRegionLeaders = 0;
+
         void createDispatchBlock();
-        void jumpToDispatch();
+        void createDispatchTable();
+        void emitDispatch(llvm::Value* index, const TargetCounts* counts);
+        void jumpToDispatch(llvm::Value* index = nullptr,
+                            const TargetCounts* counts = nullptr);
+
+        // Counts from the first tier, turned into branch weights when present
+        Profile* profile = nullptr;
+        std::vector<RegionProfile> regionProfiles;
+        const RegionProfile* currentProfile = nullptr;
+        llvm::MDNode* branchWeights(const std::vector<uint64_t>& counts);
+        void promoteHotTargets(llvm::Value* index, TargetCounts& counts);
+
+        // Constant targets each goto in the region can take, and the leaders
+        // some goto enters directly. Those carry registers across the edge
+        // in SSA form, so loops stay out of the state and the dispatcher.
+        std::vector<std::vector<uint32_t>> gotoTargets;
+        std::vector<bool> directTargets;
+        void findDirectGotos(size_t start, size_t end);
+        // Branches to the direct targets of the current goto, true if
+        // nothing else is left for the dispatcher
+        bool jumpDirect(llvm::Value* index, TargetCounts& counts);
+
+        // With block functions, every leader is a function of its own in the
+        // GHC convention, taking the state and the registers. Fallthrough,
+        // direct gotos and dispatch become tail calls between them, so
+        // codegen sees many small functions instead of one huge one.
+        std::vector<llvm::Function*> blockFunctions;
+        llvm::FunctionType* blockFunctionType();
+        void startBlockFunction(size_t local);
+        std::vector<llvm::Value*> blockArguments();
+        void callBlock(llvm::Value* callee, const std::vector<llvm::Value*>& arguments,
+                       bool tail);
+        void emitBlockDispatch(llvm::Value* index, const TargetCounts* counts);
+        // Where a goto to a leader branches, a tail call with block functions
+        llvm::BasicBlock* enterLeader(uint32_t target, bool direct);
+
+        // Blocks that store the UM state and hand control back to the driver
+        llvm::BasicBlock* missBlock = nullptr;
+        llvm::BasicBlock* reloadBlock = nullptr;
+        llvm::BasicBlock* leaveBlock = nullptr;
+        llvm::BasicBlock* createExitBlock(const std::string& name, UMExit code);
+        llvm::Value* statePointer(unsigned slot);
+
+        void createModule(const std::string& functionName);
+        void compileInstruction(uint32_t word);
+
+        // main loops over the regions, calling each through a lazy stub
+        std::unique_ptr<llvm::Module> buildMainModule();
+        // Translated and optimized, or only translated
+        std::unique_ptr<llvm::Module> buildRegion(size_t region);
+        std::unique_ptr<llvm::Module> translateRegion(size_t region);
+        void emitRegion(std::unique_ptr<llvm::orc::MaterializationResponsibility> R,
+                        size_t region);
+        void emitMain(std::unique_ptr<llvm::orc::MaterializationResponsibility> R);
+        // Runs a layer's emit, timing the link for the telemetry report
+        void emitTimed(const std::function<void()>& emit);
 
         // llvm::Function* mapFunc;
         // llvm::Function* unmapFunc;
 
         // Execution engine
+        CompilerOptions options;
         std::unique_ptr<llvm::orc::LLJIT> jit;
 
+        // With several compile threads, regions are materialized in
+        // parallel, but IR is still built one module at a time in the
+        // shared context. Each is then cloned into a context of its own, so
+        // the pass pipeline and codegen run without the lock. With one
+        // thread there is no clone, and the pipeline runs under it.
+        std::mutex buildMutex;
+        llvm::orc::ThreadSafeModule takeModule(std::unique_ptr<llvm::Module> built);
+
+        // Target selected for code generation, detected from the host
+        std::unique_ptr<llvm::orc::JITTargetMachineBuilder> targetMachineBuilder;
+        std::string targetTriple;
+        std::string targetCPU;
+        std::string targetFeatures;
+        std::string dataLayout;
+
+        // Compiled objects from earlier runs, if caching is enabled
+        std::unique_ptr<DiskObjectCache> objectCache;
+        std::string targetKey;
+        std::string programKey;
+        std::string regionKey(size_t region) const;
+        std::string mainKey() const;
+
+        // Region bodies live in their own dylib behind lazy reexports
+        llvm::orc::JITDylib* regionDylib = nullptr;
+        std::unique_ptr<llvm::orc::LazyCallThroughManager> callThroughManager;
+        std::unique_ptr<llvm::orc::IndirectStubsManager> stubsManager;
+        llvm::orc::ResourceTrackerSP mainTracker;
+        llvm::orc::ResourceTrackerSP regionTracker;
+
  
         // Load Register
         void setRegisterValues(int reg, int value);
@@ -92,28 +272,60 @@ class Compiler {
 
         std::vector<llvm::BasicBlock*> instructionLabels;
 
+        // Where gotos enter each leader; the label itself on the alloca path
+        std::vector<llvm::BasicBlock*> landingBlocks;
+        void foldEmptyLandingBlocks();
+
         llvm::BasicBlock* haltBlock = nullptr;
 
         void createHaltBlock();
-            
-    public:
-        void createInstructionLabels(size_t numInstructions);
 
-        void jumpToFirstInstruction();
+        void createInstructionLabels(size_t start, size_t end);
 
-
-        Compiler();
-        // Compiler(size_t programSize);
+        void jumpToFirstInstruction();
 
         void compileLoadProgram(int regB, int regC);
 
-        // Halt instruction compilation must be kept public for now
         void finishProgram();
+            
+    public:
+        Compiler(const CompilerOptions& options = CompilerOptions());
+        // Compiler(size_t programSize);
 
-        void compileInstruction(uint32_t word);
+        // Take a new program; regions are translated when first called.
+        // entry holds the registers it starts with, all zero if null.
+        void compileProgram(const std::vector<uint32_t>& words,
+                            const UMState* entry = nullptr);
 
         void printIR();
 
+        void printTarget();
+
+        void benchmarkCompile();
+
+        // Write the whole program as one native object, for --emit-obj
+        llvm::Error emitObject(const std::string& path);
+
         llvm::Error executeJIT();
 
+        // Pieces the tiered runtime drives one region at a time
+        llvm::Error addProgram();
+        llvm::Error discardProgram();
+        void reloadProgram(const UMState& state);
+        llvm::Error redefineRegion(size_t region);
+        // Compiles the regions, in parallel with compile threads, and
+        // returns once all are done. ready gets each one as it finishes,
+        // possibly on a compile thread; those that fail are in the error.
+        using RegionReady = std::function<void(size_t, RegionFunction)>;
+        llvm::Error compileRegions(const std::vector<size_t>& regions,
+                                   const RegionReady& ready);
+        void addLeader(size_t index);
+        void setRegionProfile(size_t region, RegionProfile regionProfile);
+
+        // Counts for each program are selected from here as it is loaded
+        void setProfile(Profile* profile);
+        size_t programSize() const;
+        size_t numRegions() const;
+        unsigned compileThreads() const;
+
 };
@@ -0,0 +1,313 @@
+#include "copy_loops.hpp"
+
+#include <vector>
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+
+/* UM words are all this wide, in segments and in the program image */
+#define WORD_BYTES 4
+
+/* A loop that copies one word each time round, and what it leaves behind */
+struct CopyLoop {
+    llvm::Loop* loop;
+    llvm::LoadInst* load;
+    llvm::StoreInst* store;
+    const llvm::SCEVAddRecExpr* source;
+    const llvm::SCEVAddRecExpr* destination;
+    const llvm::SCEV* backedges;                  // one less than the trips
+    std::vector<llvm::PHINode*> results;          // in the exit block
+    std::vector<const llvm::SCEV*> resultValues;  // null for the last load
+};
+
+/* The address, if it moves on by exactly one word each trip round the loop */
+static const llvm::SCEVAddRecExpr* wordAddress(llvm::ScalarEvolution& evolution,
+                                               llvm::Value* pointer, llvm::Loop* loop)
+{
+    auto* address = llvm::dyn_cast<llvm::SCEVAddRecExpr>(evolution.getSCEV(pointer));
+    if (!address || address->getLoop() != loop || !address->isAffine()) {
+        return nullptr;
+    }
+    auto* step = llvm::dyn_cast<llvm::SCEVConstant>(address->getStepRecurrence(evolution));
+    if (!step || step->getAPInt() != WORD_BYTES) {
+        return nullptr;
+    }
+    return address;
+}
+
+/* Unswitching leaves the branch it decided in the loop as a branch on a
+ * constant, which still counts as a way out. Drop those edges, so the latch
+ * is left as the only exit again. */
+static bool foldDecidedExits(llvm::Loop* loop, llvm::DominatorTree& dominators)
+{
+    bool changed = false;
+    for (llvm::BasicBlock* block : loop->blocks()) {
+        auto* branch = llvm::dyn_cast<llvm::BranchInst>(block->getTerminator());
+        if (!branch || !branch->isConditional()) {
+            continue;
+        }
+        auto* condition = llvm::dyn_cast<llvm::ConstantInt>(branch->getCondition());
+        if (!condition) {
+            continue;
+        }
+        llvm::BasicBlock* taken = branch->getSuccessor(condition->isZero() ? 1 : 0);
+        llvm::BasicBlock* dead = branch->getSuccessor(condition->isZero() ? 0 : 1);
+        if (taken == dead || loop->contains(dead)) {
+            continue;
+        }
+        dead->removePredecessor(block);
+        llvm::BranchInst::Create(taken, branch);
+        branch->eraseFromParent();
+        dominators.applyUpdates({{llvm::DominatorTree::Delete, block, dead}});
+        changed = true;
+    }
+    return changed;
+}
+
+static bool findCopy(llvm::Loop* loop, llvm::ScalarEvolution& evolution,
+                     llvm::DominatorTree& dominators, llvm::SCEVExpander& expander,
+                     CopyLoop& copy)
+{
+    // Entered from one place and left from the latch to a block of its own,
+    // so the copy can go around it
+    llvm::BasicBlock* latch = loop->getLoopLatch();
+    llvm::BasicBlock* exit = loop->getExitBlock();
+    if (!loop->isInnermost() || !loop->getLoopPreheader() || !latch || !exit
+        || loop->getExitingBlock() != latch || exit->getSinglePredecessor() != latch) {
+        return false;
+    }
+
+    copy.loop = loop;
+    copy.load = nullptr;
+    copy.store = nullptr;
+    for (llvm::BasicBlock* block : loop->blocks()) {
+        for (llvm::Instruction& instruction : *block) {
+            // Values only leave through the exit block's phis, which LCSSA
+            // puts there
+            for (llvm::User* user : instruction.users()) {
+                auto* userInstruction = llvm::cast<llvm::Instruction>(user);
+                if (!loop->contains(userInstruction)
+                    && (userInstruction->getParent() != exit
+                        || !llvm::isa<llvm::PHINode>(userInstruction))) {
+                    return false;
+                }
+            }
+
+            // The offset assumptions only matter while the loop is there
+            if (llvm::isa<llvm::AssumeInst>(instruction)) {
+                continue;
+            }
+            if (auto* load = llvm::dyn_cast<llvm::LoadInst>(&instruction)) {
+                if (copy.load || !load->isSimple()) {
+                    return false;
+                }
+                copy.load = load;
+                continue;
+            }
+            if (auto* store = llvm::dyn_cast<llvm::StoreInst>(&instruction)) {
+                if (copy.store || !store->isSimple()) {
+                    return false;
+                }
+                copy.store = store;
+                continue;
+            }
+            if (instruction.mayReadOrWriteMemory() || instruction.mayHaveSideEffects()) {
+                return false;
+            }
+        }
+    }
+
+    // Exactly one word moves on every trip
+    if (!copy.load || !copy.store || copy.store->getValueOperand() != copy.load
+        || !copy.load->getType()->isIntegerTy(32)
+        || !dominators.dominates(copy.load->getParent(), latch)
+        || !dominators.dominates(copy.store->getParent(), latch)) {
+        return false;
+    }
+
+    copy.source = wordAddress(evolution, copy.load->getPointerOperand(), loop);
+    copy.destination = wordAddress(evolution, copy.store->getPointerOperand(), loop);
+    copy.backedges = evolution.getBackedgeTakenCount(loop);
+    if (!copy.source || !copy.destination
+        || llvm::isa<llvm::SCEVCouldNotCompute>(copy.backedges)
+        || !expander.isSafeToExpand(copy.source->getStart())
+        || !expander.isSafeToExpand(copy.destination->getStart())
+        || !expander.isSafeToExpand(copy.backedges)) {
+        return false;
+    }
+
+    // Whatever the loop hands on must be known without running it
+    copy.results.clear();
+    copy.resultValues.clear();
+    for (llvm::PHINode& result : exit->phis()) {
+        auto* value = llvm::dyn_cast<llvm::Instruction>(result.getIncomingValue(0));
+        if (!value || !loop->contains(value)) {
+            continue;
+        }
+        const llvm::SCEV* exitValue = nullptr;
+        if (value != copy.load) {
+            exitValue = evolution.getSCEVAtScope(value, loop->getParentLoop());
+            if (llvm::isa<llvm::SCEVCouldNotCompute>(exitValue)
+                || !evolution.isLoopInvariant(exitValue, loop)
+                || !expander.isSafeToExpand(exitValue)) {
+                return false;
+            }
+        }
+        copy.results.push_back(&result);
+        copy.resultValues.push_back(exitValue);
+    }
+    return true;
+}
+
+static void versionCopy(CopyLoop& copy, llvm::ScalarEvolution& evolution,
+                        llvm::DominatorTree& dominators, llvm::LoopInfo& loops,
+                        llvm::SCEVExpander& expander)
+{
+    llvm::Loop* loop = copy.loop;
+    llvm::BasicBlock* preheader = loop->getLoopPreheader();
+    llvm::BasicBlock* header = loop->getHeader();
+    llvm::BasicBlock* exit = loop->getExitBlock();
+    llvm::Function* function = header->getParent();
+    llvm::LLVMContext& context = function->getContext();
+    llvm::Type* i64 = llvm::Type::getInt64Ty(context);
+    llvm::Type* pointerType = copy.load->getPointerOperandType();
+
+    // Everything is expanded in the preheader, which the dominator tree
+    // and loop info already know about
+    llvm::BranchInst* entry = llvm::cast<llvm::BranchInst>(preheader->getTerminator());
+    const llvm::SCEV* trips = evolution.getAddExpr(
+        evolution.getZeroExtendExpr(copy.backedges, i64),
+        evolution.getOne(i64)
+    );
+    const llvm::SCEV* bytes = evolution.getMulExpr(trips, evolution.getConstant(i64, WORD_BYTES));
+    llvm::Value* source = expander.expandCodeFor(copy.source->getStart(), pointerType, entry);
+    llvm::Value* destination = expander.expandCodeFor(
+        copy.destination->getStart(), pointerType, entry
+    );
+    llvm::Value* length = expander.expandCodeFor(bytes, i64, entry);
+
+    std::vector<llvm::Value*> results;
+    llvm::Value* lastSource = nullptr;
+    for (const llvm::SCEV* value : copy.resultValues) {
+        if (value) {
+            results.push_back(expander.expandCodeFor(value, value->getType(), entry));
+            continue;
+        }
+        if (!lastSource) {
+            lastSource = expander.expandCodeFor(
+                copy.source->evaluateAtIteration(copy.backedges, evolution),
+                pointerType,
+                entry
+            );
+        }
+        results.push_back(nullptr);
+    }
+
+    // A forward copy of overlapping ranges is still a memmove when the
+    // destination starts at or below the source; otherwise it repeats
+    // what it has already copied, and only the loop does that
+    llvm::IRBuilder<> builder(entry);
+    llvm::Value* sourceStart = builder.CreatePtrToInt(source, i64, "copy_source");
+    llvm::Value* destinationStart = builder.CreatePtrToInt(destination, i64, "copy_destination");
+    llvm::Value* disjoint = builder.CreateOr(
+        builder.CreateICmpULE(builder.CreateAdd(destinationStart, length), sourceStart),
+        builder.CreateICmpULE(builder.CreateAdd(sourceStart, length), destinationStart),
+        "copy_disjoint"
+    );
+    llvm::Value* forward = builder.CreateICmpULE(destinationStart, sourceStart, "copy_forward");
+
+    llvm::BasicBlock* copyBlock = llvm::BasicBlock::Create(context, "copy", function, header);
+    llvm::BasicBlock* memcpyBlock = llvm::BasicBlock::Create(context, "copy_memcpy", function, header);
+    llvm::BasicBlock* memmoveBlock = llvm::BasicBlock::Create(context, "copy_memmove", function, header);
+    builder.CreateCondBr(builder.CreateOr(disjoint, forward), copyBlock, header);
+    entry->eraseFromParent();
+
+    // The last word the loop would have loaded, read before the copy can
+    // overwrite it
+    builder.SetInsertPoint(copyBlock);
+    llvm::LoadInst* lastLoad = nullptr;
+    if (lastSource) {
+        lastLoad = llvm::cast<llvm::LoadInst>(copy.load->clone());
+        lastLoad->setOperand(0, lastSource);
+        lastLoad->setName("copy_last");
+        builder.Insert(lastLoad);
+    }
+    builder.CreateCondBr(disjoint, memcpyBlock, memmoveBlock);
+
+    llvm::AAMDNodes tags = copy.store->getAAMetadata().merge(copy.load->getAAMetadata());
+    builder.SetInsertPoint(memcpyBlock);
+    builder.CreateMemCpy(destination, llvm::Align(WORD_BYTES), source, llvm::Align(WORD_BYTES),
+                         length)->setAAMetadata(tags);
+    builder.CreateBr(exit);
+    builder.SetInsertPoint(memmoveBlock);
+    builder.CreateMemMove(destination, llvm::Align(WORD_BYTES), source, llvm::Align(WORD_BYTES),
+                          length)->setAAMetadata(tags);
+    builder.CreateBr(exit);
+
+    for (size_t i = 0; i < copy.results.size(); i++) {
+        llvm::Value* value = results[i] ? results[i] : lastLoad;
+        copy.results[i]->addIncoming(value, memcpyBlock);
+        copy.results[i]->addIncoming(value, memmoveBlock);
+        evolution.forgetValue(copy.results[i]);
+    }
+
+    // Keep both up to date for the loops still to come
+    dominators.applyUpdates({
+        {llvm::DominatorTree::Insert, preheader, copyBlock},
+        {llvm::DominatorTree::Insert, copyBlock, memcpyBlock},
+        {llvm::DominatorTree::Insert, copyBlock, memmoveBlock},
+        {llvm::DominatorTree::Insert, memcpyBlock, exit},
+        {llvm::DominatorTree::Insert, memmoveBlock, exit},
+    });
+    if (llvm::Loop* parent = loop->getParentLoop()) {
+        parent->addBasicBlockToLoop(copyBlock, loops);
+        parent->addBasicBlockToLoop(memcpyBlock, loops);
+        parent->addBasicBlockToLoop(memmoveBlock, loops);
+    }
+}
+
+llvm::PreservedAnalyses CopyLoopPass::run(llvm::Function& function,
+                                          llvm::FunctionAnalysisManager& analyses)
+{
+    if (function.isDeclaration()) {
+        return llvm::PreservedAnalyses::all();
+    }
+
+    llvm::LoopInfo& loops = analyses.getResult<llvm::LoopAnalysis>(function);
+    if (loops.empty()) {
+        return llvm::PreservedAnalyses::all();
+    }
+    llvm::ScalarEvolution& evolution = analyses.getResult<llvm::ScalarEvolutionAnalysis>(function);
+    llvm::DominatorTree& dominators = analyses.getResult<llvm::DominatorTreeAnalysis>(function);
+    llvm::SCEVExpander expander(evolution, function.getParent()->getDataLayout(), "copy");
+
+    // Find them all first: versioning one adds blocks the next search
+    // would have to step around
+    std::vector<CopyLoop> copies;
+    bool changed = false;
+    for (llvm::Loop* loop : loops.getLoopsInPreorder()) {
+        if (loop->isInnermost() && foldDecidedExits(loop, dominators)) {
+            evolution.forgetLoop(loop);
+            changed = true;
+        }
+        CopyLoop copy;
+        if (findCopy(loop, evolution, dominators, expander, copy)) {
+            copies.push_back(std::move(copy));
+        }
+    }
+    if (copies.empty()) {
+        return changed ? llvm::PreservedAnalyses::none() : llvm::PreservedAnalyses::all();
+    }
+
+    for (CopyLoop& copy : copies) {
+        versionCopy(copy, evolution, dominators, loops, expander);
+    }
+    return llvm::PreservedAnalyses::none();
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
+
+/* Loop idiom recognition turns fills into memset, but leaves a loop that
+ * copies one segment into another alone: every segment is an offset into
+ * the same arena, so nothing proves the two ranges apart. This versions
+ * each countable innermost loop that does nothing but load a word and
+ * store it one word further along each time, on a check made before the
+ * loop runs:
+ *   - ranges that do not overlap are copied with memcpy,
+ *   - a destination at or below the source with memmove, which is what a
+ *     forward copy does to overlapping ranges too,
+ *   - anything else runs the loop as it was.
+ * Values the loop leaves behind for later code are worked out from scalar
+ * evolution, and the last word loaded is read again. Runs after the loop
+ * passes, once unswitching has taken the segment 0 write barrier out of
+ * the loop; the exits it decided on are folded away here first. */
+class CopyLoopPass : public llvm::PassInfoMixin<CopyLoopPass> {
+    public:
+        llvm::PreservedAnalyses run(llvm::Function& function,
+                                    llvm::FunctionAnalysisManager& analyses);
+};
@@ -0,0 +1,145 @@
+#include "interpreter.hpp"
+
+#include <cstdio>
+
+extern "C" {
+    #include "virt.h"
+}
+
+// Instantiated twice so the uninstrumented loop pays nothing for profiling
+template <bool Profiled>
+static UMExit run(UMState& state, GotoObserver& observer, Profile* profile)
+{
+    uint32_t regs[8];
+    for (int i = 0; i < 8; i++) {
+        regs[i] = state.regs[i];
+    }
+    uint32_t pc = state.pc;
+
+    UMExit exit;
+
+    while (true) {
+        uint32_t word = get_at(usable, pc * sizeof(uint32_t));
+        pc++;
+
+        uint32_t opcode = word >> 28;
+
+        /* Load Value */
+        if (__builtin_expect(opcode == 13, 1)) {
+            regs[(word >> 25) & 0x7] = word & 0x1FFFFFF;
+            continue;
+        }
+
+        uint32_t c = word & 0x7;
+        uint32_t b = (word >> 3) & 0x7;
+        uint32_t a = (word >> 6) & 0x7;
+
+        /* Segmented Load */
+        if (__builtin_expect(opcode == 1, 1)) {
+            regs[a] = get_at(usable, regs[b] + regs[c] * sizeof(uint32_t));
+        }
+
+        /* Segmented Store */
+        else if (__builtin_expect(opcode == 2, 1)) {
+            set_at(usable, regs[a] + regs[b] * sizeof(uint32_t), regs[c]);
+            if (__builtin_expect(regs[a] == 0, 0) && !um_segment_zero_written) {
+                um_segment_zero_written = 1;
+                if (um_segment_zero_assumed) {
+                    exit = UM_EXIT_RELOAD;
+                    break;
+                }
+            }
+        }
+
+        /* Bitwise NAND */
+        else if (__builtin_expect(opcode == 6, 1)) {
+            regs[a] = ~(regs[b] & regs[c]);
+        }
+
+        /* Load Program */
+        else if (__builtin_expect(opcode == 12, 0)) {
+            uint32_t site = pc - 1;
+            pc = regs[c];
+            if (regs[b] != 0) {
+                if (Profiled) {
+                    profile->countReload(site);
+                }
+                um_load_program(regs[b]);
+                exit = UM_EXIT_RELOAD;
+                break;
+            }
+            if (Profiled) {
+                profile->countGoto(site, pc);
+            }
+            if (observer.onGoto(pc)) {
+                exit = UM_EXIT_JUMP;
+                break;
+            }
+        }
+
+        /* Addition */
+        else if (__builtin_expect(opcode == 3, 0)) {
+            regs[a] = regs[b] + regs[c];
+        }
+
+        /* Conditional Move */
+        else if (__builtin_expect(opcode == 0, 0)) {
+            if (Profiled) {
+                profile->countMove(pc - 1, regs[c] != 0);
+            }
+            if (regs[c] != 0) {
+                regs[a] = regs[b];
+            }
+        }
+
+        /* Map Segment */
+        else if (__builtin_expect(opcode == 8, 0)) {
+            regs[b] = vs_calloc(regs[c] * sizeof(uint32_t));
+        }
+
+        /* Unmap Segment */
+        else if (__builtin_expect(opcode == 9, 0)) {
+            vs_free(regs[c]);
+        }
+
+        /* Division */
+        else if (__builtin_expect(opcode == 5, 0)) {
+            regs[a] = regs[b] / regs[c];
+        }
+
+        /* Multiplication */
+        else if (__builtin_expect(opcode == 4, 0)) {
+            regs[a] = regs[b] * regs[c];
+        }
+
+        /* Output */
+        else if (__builtin_expect(opcode == 10, 0)) {
+            putchar((unsigned char)regs[c]);
+        }
+
+        /* Input */
+        else if (__builtin_expect(opcode == 11, 0)) {
+            regs[c] = getchar();
+        }
+
+        /* Stop or Invalid Instruction */
+        else {
+            exit = UM_EXIT_HALT;
+            break;
+        }
+    }
+
+    for (int i = 0; i < 8; i++) {
+        state.regs[i] = regs[i];
+    }
+    state.pc = pc;
+    return exit;
+}
+
+UMExit interpret(UMState& state, GotoObserver& observer, Profile* profile)
+{
+    if (profile) {
+        return run<true>(state, observer, profile);
+    }
+    return run<false>(state, observer, nullptr);
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <cstdint>
+
+#include "profile.hpp"
+#include "um_state.hpp"
+
+/* Told about every goto the interpreter takes */
+class GotoObserver {
+    public:
+        virtual ~GotoObserver() = default;
+
+        // Return true to stop interpreting and hand target to compiled code
+        virtual bool onGoto(uint32_t target) = 0;
+};
+
+/* The first execution tier: a plain interpreter over segment 0 in the Virt32
+ * arena, decoding as mod_emulator.c does. Runs from state.pc and returns
+ *   UM_EXIT_HALT    on halt,
+ *   UM_EXIT_RELOAD  after load program replaced segment 0, or after the
+ *                   first store into it,
+ *   UM_EXIT_JUMP    at a goto the observer claimed,
+ * with state holding the registers and the next instruction. Given a profile,
+ * it also counts every goto, reload and conditional move it executes. */
+UMExit interpret(UMState& state, GotoObserver& observer, Profile* profile = nullptr);
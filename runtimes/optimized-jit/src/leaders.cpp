@@ -0,0 +1,49 @@
+#include "leaders.hpp"
+
+LeaderAnalysis::LeaderAnalysis(const std::vector<uint32_t> &program)
+    : leaders(program.size(), false)
+{
+    if (program.empty()) {
+        return;
+    }
+
+    addLeader(0);
+
+    for (size_t i = 0; i < program.size(); i++) {
+        uint32_t word = program[i];
+        uint32_t opcode = (word >> 28) & 0xF;
+
+        // Halt and load program end a run, so the next word starts a new one
+        if ((opcode == 7 || opcode == 12) && i + 1 < program.size()) {
+            addLeader(i + 1);
+        }
+
+        // Goto targets are almost always materialized with load value, so an
+        // immediate that lands inside the program is treated as a target.
+        // Anything this misses is picked up by the dispatcher at runtime.
+        if (opcode == 13) {
+            uint32_t val = word & 0x1FFFFFF;
+            if (val < program.size()) {
+                addLeader(val);
+            }
+        }
+    }
+}
+
+bool LeaderAnalysis::isLeader(size_t index) const
+{
+    return index < leaders.size() && leaders[index];
+}
+
+void LeaderAnalysis::addLeader(size_t index)
+{
+    if (index < leaders.size() && !leaders[index]) {
+        leaders[index] = true;
+        numLeaders++;
+    }
+}
+
+size_t LeaderAnalysis::count() const
+{
+    return numLeaders;
+}
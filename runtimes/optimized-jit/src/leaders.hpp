@@ -0,0 +1,24 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* Finds the UM words that start a basic block. Every leader gets exactly one
+ * llvm::BasicBlock holding its straight-line run, and only leaders can be
+ * reached through the goto dispatcher. */
+class LeaderAnalysis {
+    private:
+        std::vector<bool> leaders;
+        size_t numLeaders = 0;
+
+    public:
+        LeaderAnalysis() = default;
+        LeaderAnalysis(const std::vector<uint32_t> &program);
+
+        bool isLeader(size_t index) const;
+
+        // Register a target the dispatcher discovered at runtime
+        void addLeader(size_t index);
+
+        size_t count() const;
+};
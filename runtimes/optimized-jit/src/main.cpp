@@ -2,20 +2,74 @@
 #include <fstream>
 #include <vector>
 #include <cstdint>
+#include <cstdlib>
 #include <filesystem>
+#include <thread>
+#include <algorithm>
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Program.h"
 #include "program_loader.hpp"
 #include "compiler.hpp"
+#include "tiered.hpp"
 
 extern "C" {
     #include "virt.h"
 }
 
+/* Built alongside the compiler: aot_main.cpp, the interpreter and Virt32 */
+#ifndef UM_AOT_RUNTIME
+#define UM_AOT_RUNTIME "libum_aot_runtime.a"
+#endif
+
+// Links an object from --emit-obj into a standalone executable, with $CXX.
+// No shell sees the paths, so they may hold any character.
+static bool linkExecutable(const std::string& object, const std::string& executable)
+{
+    const char* linker = std::getenv("CXX");
+    auto program = llvm::sys::findProgramByName(linker ? linker : "c++");
+    if (!program) {
+        std::cerr << "Cannot find " << (linker ? linker : "c++") << ": "
+                  << program.getError().message() << std::endl;
+        return false;
+    }
+
+    llvm::SmallVector<llvm::StringRef, 6> args = {
+        *program, "-o", executable, object, UM_AOT_RUNTIME, "-pthread"
+    };
+    std::string error;
+    int status = llvm::sys::ExecuteAndWait(*program, args, std::nullopt, {}, 0, 0, &error);
+    if (status < 0) {
+        std::cerr << "Cannot run " << *program << ": " << error << std::endl;
+    }
+    return status == 0;
+}
 
 int main(int argc, char *argv[]) {
-    if (argc < 2 || argc > 3) {
-        std::cerr << "Usage: " << argv[0] << " [program.um] [--jit|--print-ir]\n";
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " [program.um] [--jit|--print-ir] [options]\n";
         std::cerr << "  --jit: Execute program using JIT compiler (default)\n";
         std::cerr << "  --print-ir: Print LLVM IR instead of executing\n";
+        std::cerr << "  --emit-obj=FILE: Compile the whole program to a native object instead\n";
+        std::cerr << "  --emit-exe=FILE: Compile and link it with the runtime into an executable\n";
+        std::cerr << "  --print-target: Print the target code is generated for\n";
+        std::cerr << "  --bench-compile: Time compiling every region with each register lowering\n";
+        std::cerr << "  --alloca-registers: Keep UM registers in stack slots instead of SSA values\n";
+        std::cerr << "  --block-functions: Compile each block to its own function, joined by tail calls\n";
+        std::cerr << "  --no-tiering: Compile everything before running instead of interpreting first\n";
+        std::cerr << "  --tier-threshold=N: Gotos into a region before it is compiled (default 16, 0 never)\n";
+        std::cerr << "  --no-profile: Do not count branches in the interpreter or weight compiled code\n";
+        std::cerr << "  --profile-in=FILE: Start from the branch counts of an earlier run\n";
+        std::cerr << "  --profile-out=FILE: Write the branch counts out when the program halts\n";
+        std::cerr << "  -O0 .. -O3: Code generation optimization level (default -O2)\n";
+        std::cerr << "  -mcpu=CPU: Tune for CPU instead of the host\n";
+        std::cerr << "  -mattr=+a,-b: Enable or disable target features\n";
+        std::cerr << "  --cache-dir=DIR: Reuse compiled code across runs from DIR\n";
+        std::cerr << "  --cache-size=MB: Evict old cache entries past this size (default 512)\n";
+        std::cerr << "  --compile-threads=N: Regions to compile in parallel (default: one per core)\n";
+        std::cerr << "  --time-passes: Report where compile time went on stderr when done\n";
+        std::cerr << "  --time-passes-json=FILE: Write the same report to FILE as JSON\n";
+        std::cerr << "  --page-zero-min=BYTES: Drop the pages of unmapped segments this large (default 4 MB)\n";
+        std::cerr << "  --background-zeroing: Zero unmapped segments on a second thread\n";
         return EXIT_FAILURE;
     }
     
@@ -39,42 +93,156 @@ int main(int argc, char *argv[]) {
     
     // Parse command line arguments
     bool useJIT = true;
-    if (argc == 3) {
-        std::string arg(argv[2]);
+    bool printTarget = false;
+    bool benchCompile = false;
+    std::string emitObj;
+    std::string emitExe;
+    bool tiered = true;
+    unsigned tierThreshold = 16;
+    bool profiling = true;
+    std::string profileIn;
+    std::string profileOut;
+    bool timePasses = false;
+    std::string timePassesJSON;
+    uint32_t pageZeroMin = PAGE_ZERO_MIN;
+    bool backgroundZeroing = false;
+    CompilerOptions options;
+    options.compileThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    for (int i = 2; i < argc; i++) {
+        std::string arg(argv[i]);
         if (arg == "--print-ir") {
             useJIT = false;
         } else if (arg == "--jit") {
             useJIT = true;
+        } else if (arg.compare(0, 11, "--emit-obj=") == 0) {
+            emitObj = arg.substr(11);
+        } else if (arg.compare(0, 11, "--emit-exe=") == 0) {
+            emitExe = arg.substr(11);
+        } else if (arg == "--print-target") {
+            printTarget = true;
+        } else if (arg == "--bench-compile") {
+            benchCompile = true;
+        } else if (arg == "--alloca-registers") {
+            options.ssaRegisters = false;
+        } else if (arg == "--block-functions") {
+            options.blockFunctions = true;
+        } else if (arg == "--no-tiering") {
+            tiered = false;
+        } else if (arg.compare(0, 17, "--tier-threshold=") == 0) {
+            tierThreshold = std::stoul(arg.substr(17));
+        } else if (arg == "--no-profile") {
+            profiling = false;
+        } else if (arg.compare(0, 13, "--profile-in=") == 0) {
+            profileIn = arg.substr(13);
+        } else if (arg.compare(0, 14, "--profile-out=") == 0) {
+            profileOut = arg.substr(14);
+        } else if (arg.compare(0, 6, "-mcpu=") == 0) {
+            options.cpu = arg.substr(6);
+        } else if (arg.compare(0, 7, "-mattr=") == 0) {
+            options.features = arg.substr(7);
+        } else if (arg.size() == 3 && arg.compare(0, 2, "-O") == 0
+                   && arg[2] >= '0' && arg[2] <= '3') {
+            options.optLevel = arg[2] - '0';
+        } else if (arg.compare(0, 12, "--cache-dir=") == 0) {
+            options.cacheDir = arg.substr(12);
+        } else if (arg.compare(0, 13, "--cache-size=") == 0) {
+            options.cacheLimit = std::stoull(arg.substr(13)) << 20;
+        } else if (arg.compare(0, 18, "--compile-threads=") == 0) {
+            options.compileThreads = std::max(std::stoul(arg.substr(18)), 1ul);
+        } else if (arg == "--time-passes") {
+            timePasses = true;
+        } else if (arg.compare(0, 19, "--time-passes-json=") == 0) {
+            timePassesJSON = arg.substr(19);
+        } else if (arg.compare(0, 16, "--page-zero-min=") == 0) {
+            pageZeroMin = std::stoul(arg.substr(16));
+        } else if (arg == "--background-zeroing") {
+            backgroundZeroing = true;
         } else {
             std::cerr << "Unknown argument: " << arg << std::endl;
             return EXIT_FAILURE;
         }
     }
     
-    ProgramLoader loader;
-    loader.load_file(file);
+    if (options.blockFunctions && !options.ssaRegisters) {
+        std::cerr << "Error: --block-functions passes registers as SSA values, "
+                  << "so it cannot be combined with --alloca-registers\n";
+        return EXIT_FAILURE;
+    }
 
-    uint8_t *umem = init_memory_system(fileSize);
-    
-    // At this point, turn things over to the compiler
-    Compiler compiler;
+    Profile profile;
+    if (!profileIn.empty() && !profile.load(profileIn)) {
+        std::cerr << "Error: Could not read profile " << profileIn << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    CompileTelemetry telemetry;
+    if (timePasses || !timePassesJSON.empty()) {
+        options.telemetry = &telemetry;
+    }
 
-    compiler.createInstructionLabels(loader.program.size());
+    ProgramLoader loader;
+    auto decodeStart = CompileTelemetry::now();
+    loader.load_file(file);
+    telemetry.addTime(PHASE_DECODE, CompileTelemetry::since(decodeStart));
 
-    // Create initial branch to first instruction (add this line)
-    compiler.jumpToFirstInstruction();
+    uint8_t *umem = init_memory_system(KERN_SIZE);
+    page_zero_min = pageZeroMin;
+    if (backgroundZeroing && !start_background_zeroing()) {
+        std::cerr << "Warning: Could not start the zeroing thread, zeroing on map instead\n";
+    }
 
+    // Segment 0 holds the program in the arena, as in the other runtimes
+    kern_realloc(fileSize);
     for (size_t i = 0; i < loader.program.size(); i++) {
-        uint32_t word = loader.program[i];
-        compiler.compileInstruction(word);
-        set_at(umem, 0 + (i / 4) * sizeof(uint32_t), word);
-
+        set_at(umem, i * sizeof(uint32_t), loader.program[i]);
     }
+    
+    // At this point, turn things over to the compiler
+    Compiler compiler(options);
+    if (profiling) {
+        compiler.setProfile(&profile);
+    }
+    compiler.compileProgram(loader.program);
 
-    // Adding this here to avoid putting a terminating block in the middle of a program
-    compiler.finishProgram();
+    if (printTarget) {
+        compiler.printTarget();
+    }
     
-    if (useJIT) {
+    if (benchCompile) {
+        compiler.benchmarkCompile();
+    } else if (!emitObj.empty() || !emitExe.empty()) {
+        // Pay for compiling everything once, ahead of time
+        std::string objectPath = emitObj.empty() ? emitExe + ".o" : emitObj;
+        // An object only made for the link goes, however far it got
+        auto removeObject = [&] {
+            if (emitObj.empty()) {
+                std::error_code ec;
+                std::filesystem::remove(objectPath, ec);
+            }
+        };
+        if (auto err = compiler.emitObject(objectPath)) {
+            std::cerr << "Failed to emit object: " << toString(std::move(err)) << std::endl;
+            removeObject();
+            return EXIT_FAILURE;
+        }
+        auto linkStart = CompileTelemetry::now();
+        if (!emitExe.empty() && !linkExecutable(objectPath, emitExe)) {
+            std::cerr << "Failed to link " << emitExe << std::endl;
+            removeObject();
+            return EXIT_FAILURE;
+        }
+        if (!emitExe.empty()) {
+            telemetry.addTime(PHASE_LINK, CompileTelemetry::since(linkStart));
+        }
+        removeObject();
+    } else if (useJIT && tiered) {
+        // Interpret first and move hot regions to compiled code
+        TieredRuntime runtime(compiler, tierThreshold, profiling ? &profile : nullptr);
+        if (auto err = runtime.run()) {
+            std::cerr << "JIT execution failed: " << toString(std::move(err)) << std::endl;
+            return EXIT_FAILURE;
+        }
+    } else if (useJIT) {
         // Execute using JIT
         if (auto err = compiler.executeJIT()) {
             std::cerr << "JIT execution failed: " << toString(std::move(err)) << std::endl;
@@ -86,6 +254,24 @@ int main(int argc, char *argv[]) {
         compiler.printIR();
     }
 
+    if (!profileOut.empty() && !profile.save(profileOut)) {
+        std::cerr << "Error: Could not write profile " << profileOut << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (timePasses) {
+        telemetry.print(llvm::errs());
+    }
+    if (!timePassesJSON.empty()) {
+        std::error_code ec;
+        llvm::raw_fd_ostream out(timePassesJSON, ec);
+        if (ec) {
+            std::cerr << "Error: Could not write " << timePassesJSON << std::endl;
+            return EXIT_FAILURE;
+        }
+        telemetry.writeJSON(out);
+    }
+
     terminate_memory_system();
     
     return 0;
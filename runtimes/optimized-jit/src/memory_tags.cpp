@@ -0,0 +1,46 @@
+#include "memory_tags.hpp"
+
+#include <vector>
+
+#include "llvm/IR/MDBuilder.h"
+
+static const char* const memoryNames[UM_MEMORY_KINDS] = {
+    "um register",
+    "um pc",
+    "um segment zero",
+    "um arena",
+};
+
+MemoryTags::MemoryTags(llvm::LLVMContext& context)
+{
+    llvm::MDBuilder metadata(context);
+
+    // Named nodes are uniqued, so every module gets the same ones
+    llvm::MDNode* root = metadata.createTBAARoot("um memory");
+    llvm::MDNode* domain = metadata.createAliasScopeDomain("um memory");
+    llvm::Metadata* scope[UM_MEMORY_KINDS];
+
+    for (unsigned memory = 0; memory < UM_MEMORY_KINDS; memory++) {
+        llvm::MDNode* type = metadata.createTBAAScalarTypeNode(memoryNames[memory], root);
+        typeTags[memory] = metadata.createTBAAStructTagNode(type, type, 0);
+        scope[memory] = metadata.createAliasScope(memoryNames[memory], domain);
+    }
+
+    for (unsigned memory = 0; memory < UM_MEMORY_KINDS; memory++) {
+        std::vector<llvm::Metadata*> others;
+        for (unsigned other = 0; other < UM_MEMORY_KINDS; other++) {
+            if (other != memory) {
+                others.push_back(scope[other]);
+            }
+        }
+        otherScopes[memory] = llvm::MDNode::get(context, others);
+        scopes[memory] = llvm::MDNode::get(context, {scope[memory]});
+    }
+}
+
+void MemoryTags::tag(llvm::Instruction* access, UMMemory memory) const
+{
+    access->setMetadata(llvm::LLVMContext::MD_tbaa, typeTags[memory]);
+    access->setMetadata(llvm::LLVMContext::MD_alias_scope, scopes[memory]);
+    access->setMetadata(llvm::LLVMContext::MD_noalias, otherScopes[memory]);
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Metadata.h"
+
+/* The kinds of memory compiled UM code touches, none of which overlap */
+enum UMMemory {
+    UM_MEMORY_REGISTERS = 0,  /* UMState registers, or their allocas */
+    UM_MEMORY_PC,             /* UMState pc, or the next instruction alloca */
+    UM_MEMORY_SEGMENT_ZERO,   /* The constant image of segment 0 */
+    UM_MEMORY_ARENA,          /* Segments in the Virt32 arena */
+    UM_MEMORY_KINDS
+};
+
+/* TBAA and scoped noalias metadata telling LLVM that accesses to different
+ * kinds of UM memory never alias, so a store to a segment does not force
+ * registers to be reloaded and the other way round. Accesses left untagged,
+ * such as those in the Virt32 helpers, may still alias anything. */
+class MemoryTags {
+    private:
+        llvm::MDNode* typeTags[UM_MEMORY_KINDS] = {};
+        llvm::MDNode* scopes[UM_MEMORY_KINDS] = {};
+        llvm::MDNode* otherScopes[UM_MEMORY_KINDS] = {};
+
+    public:
+        MemoryTags() = default;
+        explicit MemoryTags(llvm::LLVMContext& context);
+
+        // Tag a load or store with the memory it accesses
+        void tag(llvm::Instruction* access, UMMemory memory) const;
+};
@@ -0,0 +1,179 @@
+#include "object_cache.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <system_error>
+#include <thread>
+
+#include <unistd.h>
+
+#include "llvm/ADT/StringExtras.h"
+
+DiskObjectCache::DiskObjectCache(const std::string& directory, uint64_t sizeLimit)
+    : directory(directory), sizeLimit(sizeLimit)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+
+    for (auto& file : std::filesystem::directory_iterator(directory, ec)) {
+        std::error_code statError;
+        uint64_t size = file.file_size(statError);
+        if (file.path().extension() == ".o" && !statError) {
+            totalSize += size;
+        }
+    }
+}
+
+std::string DiskObjectCache::pathFor(const std::string& key) const
+{
+    return (std::filesystem::path(directory) / (key + ".o")).string();
+}
+
+std::unique_ptr<llvm::MemoryBuffer> DiskObjectCache::lookup(const std::string& key)
+{
+    std::string path = pathFor(key);
+    auto buffer = llvm::MemoryBuffer::getFile(path, false, false);
+    if (!buffer) {
+        return nullptr;
+    }
+
+    // Touch the entry so eviction treats it as recently used
+    std::error_code ec;
+    std::filesystem::last_write_time(
+        path,
+        std::filesystem::file_time_type::clock::now(),
+        ec
+    );
+
+    return std::move(*buffer);
+}
+
+void DiskObjectCache::store(const std::string& key, llvm::MemoryBufferRef object)
+{
+    // Write to a private name and rename, so concurrent runs and compile
+    // threads never see a partially written object
+    std::string path = pathFor(key);
+    std::string temp = path + ".tmp" + std::to_string(getpid()) + "."
+        + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    {
+        std::ofstream out(temp, std::ios::binary);
+        if (!out) {
+            return;
+        }
+        out.write(object.getBufferStart(), object.getBufferSize());
+        if (!out) {
+            std::error_code ec;
+            std::filesystem::remove(temp, ec);
+            return;
+        }
+    }
+
+    // An entry written again replaces the old one's bytes
+    std::error_code ec;
+    uint64_t replaced = std::filesystem::file_size(path, ec);
+    if (ec) {
+        replaced = 0;
+    }
+    std::filesystem::rename(temp, path, ec);
+    if (ec) {
+        std::filesystem::remove(temp, ec);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(sizeMutex);
+    totalSize = totalSize + object.getBufferSize() - std::min(replaced, totalSize);
+    if (totalSize > sizeLimit) {
+        evict();
+    }
+}
+
+// Called with sizeMutex held, once the running total passes the limit
+void DiskObjectCache::evict()
+{
+    struct Entry {
+        std::filesystem::path path;
+        std::filesystem::file_time_type used;
+        uint64_t size;
+    };
+
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+
+    std::error_code ec;
+    for (auto& file : std::filesystem::directory_iterator(directory, ec)) {
+        if (file.path().extension() != ".o") {
+            continue;
+        }
+        std::error_code statError;
+        uint64_t size = file.file_size(statError);
+        auto used = file.last_write_time(statError);
+        if (statError) {
+            continue;
+        }
+        entries.push_back({file.path(), used, size});
+        total += size;
+    }
+
+    totalSize = total;
+    if (total <= sizeLimit) {
+        return;
+    }
+
+    // Oldest first
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        return a.used < b.used;
+    });
+
+    for (const Entry& entry : entries) {
+        if (total <= sizeLimit) {
+            break;
+        }
+        std::error_code removeError;
+        if (std::filesystem::remove(entry.path, removeError)) {
+            total -= entry.size;
+        }
+    }
+    totalSize = total;
+}
+
+void DiskObjectCache::notifyObjectCompiled(const llvm::Module* M,
+                                           llvm::MemoryBufferRef object)
+{
+    store(M->getModuleIdentifier(), object);
+}
+
+std::unique_ptr<llvm::MemoryBuffer> DiskObjectCache::getObject(const llvm::Module* M)
+{
+    return lookup(M->getModuleIdentifier());
+}
+
+CacheKey& CacheKey::add(const void* data, size_t size)
+{
+    hash.update(llvm::ArrayRef<uint8_t>(static_cast<const uint8_t*>(data), size));
+    return *this;
+}
+
+CacheKey& CacheKey::add(const std::string& text)
+{
+    add(static_cast<uint64_t>(text.size()));
+    return add(text.data(), text.size());
+}
+
+CacheKey& CacheKey::add(uint64_t value)
+{
+    return add(&value, sizeof(value));
+}
+
+CacheKey& CacheKey::add(const std::vector<uint32_t>& words)
+{
+    add(static_cast<uint64_t>(words.size()));
+    return add(words.data(), words.size() * sizeof(uint32_t));
+}
+
+std::string CacheKey::str() const
+{
+    // Finishing the digest resets it, so finish a copy
+    llvm::SHA256 digest = hash;
+    return llvm::toHex(digest.final(), true);
+}
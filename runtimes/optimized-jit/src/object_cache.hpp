@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SHA256.h"
+
+/* A persistent cache of compiled objects, one file per key, so repeated runs
+ * of the same program skip translation and codegen. Keys are supplied by the
+ * compiler as module identifiers. When the directory grows past its size
+ * limit, the least recently used objects are evicted. */
+class DiskObjectCache : public llvm::ObjectCache {
+    private:
+        std::string directory;
+        uint64_t sizeLimit;
+
+        // Bytes in the directory as of the last scan, plus what this cache
+        // stored since. Other runs sharing the directory go uncounted until
+        // it passes the limit and eviction scans again.
+        std::mutex sizeMutex;
+        uint64_t totalSize = 0;
+
+        std::string pathFor(const std::string& key) const;
+        void evict();
+
+    public:
+        DiskObjectCache(const std::string& directory, uint64_t sizeLimit);
+
+        std::unique_ptr<llvm::MemoryBuffer> lookup(const std::string& key);
+        void store(const std::string& key, llvm::MemoryBufferRef object);
+
+        void notifyObjectCompiled(const llvm::Module* M,
+                                  llvm::MemoryBufferRef object) override;
+        std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* M) override;
+};
+
+/* SHA-256, used to build cache keys that are stable across runs. A key names
+ * an object file outright, with nothing checked on load, so two inputs must
+ * never share one. */
+class CacheKey {
+    private:
+        llvm::SHA256 hash;
+
+    public:
+        CacheKey& add(const void* data, size_t size);
+        CacheKey& add(const std::string& text);
+        CacheKey& add(uint64_t value);
+        CacheKey& add(const std::vector<uint32_t>& words);
+
+        std::string str() const;
+};
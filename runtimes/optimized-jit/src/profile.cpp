@@ -0,0 +1,171 @@
+#include "profile.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "object_cache.hpp"
+
+bool RegionProfile::empty() const
+{
+    return gotos.empty() && entries.empty() && reloads.empty() && moves.empty();
+}
+
+void Profile::ProgramCounts::resize(size_t size)
+{
+    words = size;
+    gotos.resize((size + REGION_WORDS - 1) >> REGION_SHIFT);
+    arrivals.resize(gotos.size());
+    moved.resize(size, 0);
+    kept.resize(size, 0);
+}
+
+void Profile::selectProgram(const std::vector<uint32_t>& words)
+{
+    current = &programs[CacheKey().add(words).str()];
+    if (current->words != words.size()) {
+        *current = ProgramCounts();
+        current->resize(words.size());
+    }
+}
+
+RegionProfile Profile::region(size_t region) const
+{
+    RegionProfile profile;
+    if (!current || region >= current->gotos.size()) {
+        return profile;
+    }
+
+    for (auto& [key, count] : current->gotos[region]) {
+        profile.gotos[key >> 32][key & 0xFFFFFFFF] = count;
+    }
+
+    size_t start = region << REGION_SHIFT;
+    size_t end = std::min(start + REGION_WORDS, current->words);
+
+    for (uint64_t key : current->arrivals[region]) {
+        uint32_t site = key >> 32;
+        bump(profile.entries[key & 0xFFFFFFFF], current->gotos[site >> REGION_SHIFT].at(key));
+    }
+    for (size_t site = start; site < end; site++) {
+        if (current->moved[site] || current->kept[site]) {
+            profile.moves[site] = {current->moved[site], current->kept[site]};
+        }
+    }
+
+    for (auto& [site, count] : current->reloads) {
+        if (site >= start && site < end) {
+            profile.reloads[site] = count;
+        }
+    }
+
+    return profile;
+}
+
+/* The format is plain text:
+ *   umprofile 1
+ *   program <key> <words>
+ *   goto <site> <target> <count>
+ *   reload <site> <count>
+ *   move <site> <moved> <kept>
+ *   writes_segment_zero
+ * with counts following the program line they belong to. */
+bool Profile::load(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    if (!file) {
+        return false;
+    }
+
+    std::istringstream in(contents.str());
+    std::string header;
+    int version = 0;
+    if (!(in >> header >> version) || header != "umprofile" || version != 1) {
+        return false;
+    }
+
+    std::map<std::string, ProgramCounts> loaded;
+    ProgramCounts* counts = nullptr;
+
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string kind;
+        if (!(fields >> kind)) {
+            continue;
+        }
+
+        if (kind == "program") {
+            std::string key;
+            size_t words;
+            if (!(fields >> key >> words)) {
+                return false;
+            }
+            counts = &loaded[key];
+            counts->resize(words);
+            continue;
+        }
+
+        if (kind == "writes_segment_zero" && counts) {
+            counts->writesSegmentZero = true;
+            continue;
+        }
+
+        uint32_t site, a, b;
+        if (!counts || !(fields >> site >> a) || site >= counts->words) {
+            return false;
+        }
+
+        if (kind == "goto" && fields >> b) {
+            bumpGoto(*counts, site, a, b);
+        } else if (kind == "reload") {
+            bump(counts->reloads[site], a);
+        } else if (kind == "move" && fields >> b) {
+            bump(counts->moved[site], a);
+            bump(counts->kept[site], b);
+        } else {
+            return false;
+        }
+    }
+
+    programs = std::move(loaded);
+    current = nullptr;
+    loadedKey = CacheKey().add(contents.str()).str();
+    return true;
+}
+
+bool Profile::save(const std::string& path) const
+{
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+
+    out << "umprofile 1\n";
+    for (auto& [key, counts] : programs) {
+        out << "program " << key << " " << counts.words << "\n";
+        if (counts.writesSegmentZero) {
+            out << "writes_segment_zero\n";
+        }
+        for (auto& region : counts.gotos) {
+            for (auto& [edge, count] : region) {
+                out << "goto " << (edge >> 32) << " " << (edge & 0xFFFFFFFF)
+                    << " " << count << "\n";
+            }
+        }
+        for (auto& [site, count] : counts.reloads) {
+            out << "reload " << site << " " << count << "\n";
+        }
+        for (size_t site = 0; site < counts.words; site++) {
+            if (counts.moved[site] || counts.kept[site]) {
+                out << "move " << site << " " << counts.moved[site]
+                    << " " << counts.kept[site] << "\n";
+            }
+        }
+    }
+
+    return static_cast<bool>(out);
+}
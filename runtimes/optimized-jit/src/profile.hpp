@@ -0,0 +1,116 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "um_state.hpp"
+
+// Times control went to each UM word
+typedef std::unordered_map<uint32_t, uint32_t> TargetCounts;
+
+/* What the first tier saw in one region, in the form the compiler uses */
+struct RegionProfile {
+    // Goto counts by site, then by target
+    std::unordered_map<uint32_t, TargetCounts> gotos;
+    // Gotos from anywhere in the program into each word of the region
+    TargetCounts entries;
+    // Load program from a nonzero segment, by site
+    std::unordered_map<uint32_t, uint32_t> reloads;
+    // Conditional moves by site: times the move happened, times it did not
+    std::unordered_map<uint32_t, std::pair<uint32_t, uint32_t>> moves;
+
+    bool empty() const;
+};
+
+/* Execution counts gathered by the instrumented interpreter, kept per
+ * program so a load program that replaces segment 0 starts a fresh set.
+ * Profiles can be written out and read back, so a later run of the same
+ * program compiles with them from the start. */
+class Profile {
+    private:
+        struct ProgramCounts {
+            size_t words = 0;
+            // Per region, keyed by (site << 32) | target
+            std::vector<std::unordered_map<uint64_t, uint32_t>> gotos;
+            // The same keys by the region of their target, each added when
+            // its goto is first counted, so entries need no search
+            std::vector<std::vector<uint64_t>> arrivals;
+            std::unordered_map<uint32_t, uint32_t> reloads;
+            std::vector<uint32_t> moved;
+            std::vector<uint32_t> kept;
+            bool writesSegmentZero = false;
+
+            void resize(size_t words);
+        };
+
+        std::map<std::string, ProgramCounts> programs;
+        ProgramCounts* current = nullptr;
+        // Hash of the file the counts were loaded from, if any
+        std::string loadedKey;
+
+        // Saturate rather than wrap on very long runs. Inline, so the
+        // interpreter links without the rest of this file.
+        static void bump(uint32_t& counter, uint32_t amount = 1)
+        {
+            counter = counter > UINT32_MAX - amount ? UINT32_MAX : counter + amount;
+        }
+
+        static void bumpGoto(ProgramCounts& counts, uint32_t site, uint32_t target,
+                             uint32_t amount = 1)
+        {
+            uint64_t key = ((uint64_t)site << 32) | target;
+            uint32_t& counter = counts.gotos[site >> REGION_SHIFT][key];
+            bool first = counter == 0;
+            bump(counter, amount);
+            if (first && counter != 0 && (target >> REGION_SHIFT) < counts.arrivals.size()) {
+                counts.arrivals[target >> REGION_SHIFT].push_back(key);
+            }
+        }
+
+    public:
+        // Counts from here on belong to this program
+        void selectProgram(const std::vector<uint32_t>& words);
+
+        void countGoto(uint32_t site, uint32_t target)
+        {
+            bumpGoto(*current, site, target);
+        }
+
+        void countReload(uint32_t site)
+        {
+            bump(current->reloads[site]);
+        }
+
+        void countMove(uint32_t site, bool moved)
+        {
+            bump(moved ? current->moved[site] : current->kept[site]);
+        }
+
+        RegionProfile region(size_t region) const;
+
+        // Whether the current program was seen storing into segment 0
+        bool writesSegmentZero() const
+        {
+            return current && current->writesSegmentZero;
+        }
+
+        void markSegmentZeroWritten()
+        {
+            if (current) {
+                current->writesSegmentZero = true;
+            }
+        }
+
+        bool load(const std::string& path);
+        bool save(const std::string& path) const;
+
+        // Identifies the counts load read, or empty if none were. What is
+        // counted after that is left out.
+        const std::string& loadedFrom() const
+        {
+            return loadedKey;
+        }
+};
@@ -0,0 +1,228 @@
+#include "scratch_segments.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+/* Everything that refers to one mapped segment */
+struct SegmentUses {
+    std::vector<llvm::ZExtInst*> extends;
+    std::vector<llvm::GetElementPtrInst*> segments;  // arena + segment
+    std::vector<llvm::CallInst*> frees;
+    std::vector<llvm::StoreInst*> spills;          // into the UMState
+};
+
+static std::vector<llvm::CallInst*> findMaps(llvm::Function& function,
+                                             llvm::Function* callocFunc)
+{
+    std::vector<llvm::CallInst*> maps;
+    for (llvm::User* user : callocFunc->users()) {
+        auto* call = llvm::dyn_cast<llvm::CallInst>(user);
+        if (call && call->getFunction() == &function) {
+            maps.push_back(call);
+        }
+    }
+    return maps;
+}
+
+/* A mapped segment is never segment 0, so the segment 0 write barrier on
+ * stores into it can never fire. Removing it also removes the spill on its
+ * cold path, which would otherwise make every such segment escape. */
+static bool foldSegmentZeroChecks(llvm::Function& function, llvm::Function* callocFunc)
+{
+    std::vector<llvm::BasicBlock*> branches;
+    bool changed = false;
+    for (llvm::CallInst* map : findMaps(function, callocFunc)) {
+        for (llvm::User* user : llvm::make_early_inc_range(map->users())) {
+            auto* compare = llvm::dyn_cast<llvm::ICmpInst>(user);
+            if (!compare || !compare->isEquality()) {
+                continue;
+            }
+            llvm::Value* other = compare->getOperand(compare->getOperand(0) == map ? 1 : 0);
+            auto* zero = llvm::dyn_cast<llvm::ConstantInt>(other);
+            if (!zero || !zero->isZero()) {
+                continue;
+            }
+
+            for (llvm::User* compareUser : compare->users()) {
+                if (auto* branch = llvm::dyn_cast<llvm::BranchInst>(compareUser)) {
+                    branches.push_back(branch->getParent());
+                }
+            }
+            compare->replaceAllUsesWith(llvm::ConstantInt::getBool(
+                function.getContext(),
+                compare->getPredicate() == llvm::CmpInst::ICMP_NE
+            ));
+            compare->eraseFromParent();
+            changed = true;
+        }
+    }
+
+    for (llvm::BasicBlock* block : branches) {
+        llvm::ConstantFoldTerminator(block, true);
+    }
+    if (!branches.empty()) {
+        llvm::removeUnreachableBlocks(function);
+    }
+    return changed;
+}
+
+static bool isByteOffset(llvm::GetElementPtrInst* element, llvm::Value* base)
+{
+    return element && element->getPointerOperand() == base
+        && element->getNumIndices() == 1
+        && element->getSourceElementType()->isIntegerTy(8);
+}
+
+/* False if the segment ID goes anywhere but the uses listed in SegmentUses */
+static bool collectUses(llvm::CallInst* map, llvm::Function* freeFunc, SegmentUses& uses)
+{
+    llvm::Value* usableMem = map->getArgOperand(0);
+    llvm::Value* state = map->getFunction()->getArg(0);
+
+    for (llvm::User* user : map->users()) {
+        if (auto* call = llvm::dyn_cast<llvm::CallInst>(user)) {
+            if (call->getCalledFunction() != freeFunc || call->getArgOperand(0) == map) {
+                return false;
+            }
+            uses.frees.push_back(call);
+            continue;
+        }
+
+        if (auto* store = llvm::dyn_cast<llvm::StoreInst>(user)) {
+            if (store->getPointerOperand()->stripInBoundsConstantOffsets() != state) {
+                return false;
+            }
+            uses.spills.push_back(store);
+            continue;
+        }
+
+        // Loads and stores address m[B][C] as (usable + zext(B)) + 4C
+        auto* extend = llvm::dyn_cast<llvm::ZExtInst>(user);
+        if (!extend) {
+            return false;
+        }
+        for (llvm::User* extendUser : extend->users()) {
+            auto* segment = llvm::dyn_cast<llvm::GetElementPtrInst>(extendUser);
+            if (!isByteOffset(segment, usableMem)) {
+                return false;
+            }
+            for (llvm::User* segmentUser : segment->users()) {
+                auto* element = llvm::dyn_cast<llvm::GetElementPtrInst>(segmentUser);
+                if (!isByteOffset(element, segment)) {
+                    return false;
+                }
+                for (llvm::User* access : element->users()) {
+                    if (llvm::isa<llvm::LoadInst>(access)) {
+                        continue;
+                    }
+                    auto* store = llvm::dyn_cast<llvm::StoreInst>(access);
+                    if (!store || store->getValueOperand() == element) {
+                        return false;
+                    }
+                }
+            }
+            uses.segments.push_back(segment);
+        }
+        uses.extends.push_back(extend);
+    }
+    return true;
+}
+
+static void promoteSegment(llvm::CallInst* map, uint64_t bytes, SegmentUses& uses)
+{
+    llvm::Function& function = *map->getFunction();
+    llvm::BasicBlock& entry = function.getEntryBlock();
+    llvm::IRBuilder<> builder(&entry, entry.getFirstInsertionPt());
+
+    // Word accesses still index it by byte, as they did the arena
+    bytes = std::max<uint64_t>(bytes, 4);
+    llvm::AllocaInst* scratch = builder.CreateAlloca(
+        llvm::ArrayType::get(builder.getInt8Ty(), bytes),
+        nullptr,
+        "scratch_segment"
+    );
+    scratch->setAlignment(llvm::Align(4));
+
+    // Mapping zeroes the segment, each time it runs
+    builder.SetInsertPoint(map);
+    builder.CreateMemSet(scratch, builder.getInt8(0), bytes, llvm::MaybeAlign(4));
+
+    // Constant offsets into it were folded when the accesses were built,
+    // which SROA needs to split it up
+    for (llvm::GetElementPtrInst* segment : uses.segments) {
+        segment->replaceAllUsesWith(scratch);
+        segment->eraseFromParent();
+    }
+    for (llvm::ZExtInst* extend : uses.extends) {
+        extend->eraseFromParent();
+    }
+
+    for (llvm::CallInst* free : uses.frees) {
+        free->eraseFromParent();
+    }
+
+    // Once freed the ID is only a number no segment answers to, but other
+    // regions may still test the register that holds it against 0
+    for (llvm::StoreInst* spill : uses.spills) {
+        spill->setOperand(0, builder.getInt32(SCRATCH_SEGMENT_ID));
+    }
+
+    map->eraseFromParent();
+}
+
+llvm::PreservedAnalyses ScratchSegmentPass::run(llvm::Function& function,
+                                                llvm::FunctionAnalysisManager& analyses)
+{
+    llvm::Module* module = function.getParent();
+    llvm::Function* callocFunc = module->getFunction("um_vs_calloc");
+    llvm::Function* freeFunc = module->getFunction("um_vs_free");
+    if (!callocFunc || !freeFunc || function.isDeclaration() || function.arg_empty()) {
+        return llvm::PreservedAnalyses::all();
+    }
+
+    bool changed = foldSegmentZeroChecks(function, callocFunc);
+
+    std::vector<llvm::CallInst*> maps = findMaps(function, callocFunc);
+    if (maps.empty()) {
+        return changed ? llvm::PreservedAnalyses::none() : llvm::PreservedAnalyses::all();
+    }
+
+    llvm::DominatorTree dominators(function);
+    for (llvm::CallInst* map : maps) {
+        auto* bytes = llvm::dyn_cast<llvm::ConstantInt>(map->getArgOperand(1));
+        if (!bytes || bytes->getZExtValue() > MAX_SCRATCH_BYTES) {
+            continue;
+        }
+
+        SegmentUses uses;
+        if (!collectUses(map, freeFunc, uses)) {
+            continue;
+        }
+
+        // A spill the segment can reach while still mapped lets it escape.
+        // The map dominates every free, so a free dominating the spill
+        // means this mapping was freed on the way there.
+        bool spilledAfterFree = std::all_of(
+            uses.spills.begin(), uses.spills.end(),
+            [&](llvm::StoreInst* spill) {
+                return std::any_of(uses.frees.begin(), uses.frees.end(),
+                                   [&](llvm::CallInst* free) {
+                                       return dominators.dominates(free, spill);
+                                   });
+            }
+        );
+        if (!spilledAfterFree) {
+            continue;
+        }
+
+        promoteSegment(map, bytes->getZExtValue(), uses);
+        changed = true;
+    }
+
+    return changed ? llvm::PreservedAnalyses::none() : llvm::PreservedAnalyses::all();
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
+
+/* Segments at most this big can move to the stack */
+#define MAX_SCRATCH_BYTES 1024
+
+/* What a promoted segment's ID is spilled as. Mapped IDs are never 0, so
+ * neither is this, and Virt32 IDs are multiples of BOOK_SIZE, so it cannot
+ * name a live segment either. */
+#define SCRATCH_SEGMENT_ID 1
+
+/* Scalar replacement of UM segments that never leave a region. A segment
+ * mapped by um_vs_calloc qualifies when its ID is only ever
+ *   - the segment of a load or store in the same function,
+ *   - passed to um_vs_free, or
+ *   - spilled to the UMState after it was freed, as SCRATCH_SEGMENT_ID,
+ * so nothing outside the function, including a goto or load program, can
+ * name it. Such a segment becomes a zeroed alloca, which SROA can then turn
+ * into SSA values, and its map and unmap disappear. Must run before the
+ * Virt32 helpers are inlined, while map and unmap are still calls. */
+class ScratchSegmentPass : public llvm::PassInfoMixin<ScratchSegmentPass> {
+    public:
+        llvm::PreservedAnalyses run(llvm::Function& function,
+                                    llvm::FunctionAnalysisManager& analyses);
+};
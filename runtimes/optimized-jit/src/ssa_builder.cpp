@@ -0,0 +1,139 @@
+#include "ssa_builder.hpp"
+
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/ValueHandle.h"
+
+SSABuilder::SSABuilder(unsigned numVariables, llvm::Type* type)
+    : type(type), currentDef(numVariables)
+{
+}
+
+void SSABuilder::writeVariable(unsigned variable, llvm::BasicBlock* block,
+                               llvm::Value* value)
+{
+    currentDef[variable][block] = value;
+}
+
+llvm::Value* SSABuilder::readVariable(unsigned variable, llvm::BasicBlock* block)
+{
+    auto def = currentDef[variable].find(block);
+    if (def != currentDef[variable].end()) {
+        return def->second;
+    }
+    return readVariableRecursive(variable, block);
+}
+
+llvm::Value* SSABuilder::readVariableRecursive(unsigned variable, llvm::BasicBlock* block)
+{
+    llvm::Value* value;
+
+    auto materialize = onDemand.find(block);
+    if (materialize != onDemand.end()) {
+        value = materialize->second(variable);
+    } else if (!isSealed(block)) {
+        // Not every predecessor is known yet, so finish this phi on sealing
+        llvm::PHINode* phi = createPhi(variable, block);
+        incompletePhis[block].push_back({variable, phi});
+        value = phi;
+    } else if (llvm::BasicBlock* pred = block->getSinglePredecessor()) {
+        // No merge, so no phi
+        value = readVariable(variable, pred);
+    } else if (llvm::pred_empty(block)) {
+        // Read before any write on every path
+        value = llvm::PoisonValue::get(type);
+    } else {
+        // Write the phi first to break cycles through loops
+        llvm::PHINode* phi = createPhi(variable, block);
+        writeVariable(variable, block, phi);
+        value = addPhiOperands(variable, phi);
+    }
+
+    writeVariable(variable, block, value);
+    return value;
+}
+
+llvm::Value* SSABuilder::addPhiOperands(unsigned variable, llvm::PHINode* phi)
+{
+    for (llvm::BasicBlock* pred : llvm::predecessors(phi->getParent())) {
+        phi->addIncoming(readVariable(variable, pred), pred);
+    }
+    return tryRemoveTrivialPhi(variable, phi);
+}
+
+llvm::Value* SSABuilder::tryRemoveTrivialPhi(unsigned variable, llvm::PHINode* phi)
+{
+    llvm::Value* same = nullptr;
+    for (llvm::Value* op : phi->incoming_values()) {
+        if (op == same || op == phi) {
+            continue;
+        }
+        if (same) {
+            // Merges at least two values
+            return phi;
+        }
+        same = op;
+    }
+
+    if (!same) {
+        // Unreachable or only reachable from itself
+        same = llvm::PoisonValue::get(type);
+    }
+
+    // Removing this phi may make phis that used it trivial too
+    std::vector<llvm::WeakVH> users;
+    for (llvm::User* user : phi->users()) {
+        if (user != phi && llvm::isa<llvm::PHINode>(user)) {
+            users.push_back(user);
+        }
+    }
+
+    phi->replaceAllUsesWith(same);
+    for (auto& def : currentDef[variable]) {
+        if (def.second == phi) {
+            def.second = same;
+        }
+    }
+    phi->eraseFromParent();
+
+    for (llvm::WeakVH& user : users) {
+        // Earlier removals in this loop may already have deleted it
+        llvm::Value* userValue = user;
+        if (auto* userPhi = llvm::dyn_cast_or_null<llvm::PHINode>(userValue)) {
+            tryRemoveTrivialPhi(variable, userPhi);
+        }
+    }
+
+    return same;
+}
+
+llvm::PHINode* SSABuilder::createPhi(unsigned variable, llvm::BasicBlock* block)
+{
+    llvm::IRBuilder<> phiBuilder(block, block->begin());
+    return phiBuilder.CreatePHI(type, 2, "r" + std::to_string(variable));
+}
+
+void SSABuilder::defineOnDemand(llvm::BasicBlock* block,
+                                std::function<llvm::Value*(unsigned)> materialize)
+{
+    onDemand[block] = std::move(materialize);
+}
+
+void SSABuilder::sealBlock(llvm::BasicBlock* block)
+{
+    auto pending = incompletePhis.find(block);
+    if (pending != incompletePhis.end()) {
+        std::vector<std::pair<unsigned, llvm::PHINode*>> phis = std::move(pending->second);
+        incompletePhis.erase(pending);
+        for (auto& [variable, phi] : phis) {
+            addPhiOperands(variable, phi);
+        }
+    }
+    sealedBlocks.insert(block);
+}
+
+bool SSABuilder::isSealed(llvm::BasicBlock* block) const
+{
+    return sealedBlocks.count(block) != 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Type.h"
+#include "llvm/IR/Value.h"
+
+/* Builds SSA form for a fixed set of variables while IR is being emitted,
+ * following Braun et al., "Simple and Efficient Construction of Static
+ * Single Assignment Form" (CC 2013). Each block remembers the last value
+ * written to each variable; reads that miss look through predecessors and
+ * place phis only where values actually merge.
+ *
+ * A block must be sealed once all of its predecessors are known. Reads in
+ * an unsealed block get a placeholder phi that is completed on sealing. */
+class SSABuilder {
+    private:
+        llvm::Type* type = nullptr;
+        std::vector<llvm::DenseMap<llvm::BasicBlock*, llvm::Value*>> currentDef;
+        llvm::DenseMap<llvm::BasicBlock*,
+                       std::vector<std::pair<unsigned, llvm::PHINode*>>> incompletePhis;
+        llvm::DenseSet<llvm::BasicBlock*> sealedBlocks;
+        llvm::DenseMap<llvm::BasicBlock*, std::function<llvm::Value*(unsigned)>> onDemand;
+
+        llvm::Value* readVariableRecursive(unsigned variable, llvm::BasicBlock* block);
+        llvm::Value* addPhiOperands(unsigned variable, llvm::PHINode* phi);
+        llvm::Value* tryRemoveTrivialPhi(unsigned variable, llvm::PHINode* phi);
+        llvm::PHINode* createPhi(unsigned variable, llvm::BasicBlock* block);
+
+    public:
+        SSABuilder() = default;
+        SSABuilder(unsigned numVariables, llvm::Type* type);
+
+        void writeVariable(unsigned variable, llvm::BasicBlock* block, llvm::Value* value);
+        llvm::Value* readVariable(unsigned variable, llvm::BasicBlock* block);
+
+        // Reads that reach this block create their own value instead of
+        // looking at its predecessors
+        void defineOnDemand(llvm::BasicBlock* block,
+                            std::function<llvm::Value*(unsigned)> materialize);
+
+        void sealBlock(llvm::BasicBlock* block);
+        bool isSealed(llvm::BasicBlock* block) const;
+};
@@ -0,0 +1,217 @@
+#include "telemetry.hpp"
+
+#include <memory>
+
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+
+static const char* const phaseNames[COMPILE_PHASES] = {
+    "decode",
+    "build",
+    "optimize",
+    "codegen",
+    "link",
+};
+
+double CompileTelemetry::since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void CompileTelemetry::addTime(CompilePhase phase, double seconds)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    phases[phase].seconds += seconds;
+    phases[phase].count++;
+}
+
+void CompileTelemetry::addPassTime(llvm::StringRef pass, double seconds)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& [name, total] : passes) {
+        if (name == pass) {
+            total.seconds += seconds;
+            total.count++;
+            return;
+        }
+    }
+    passes.emplace_back(pass.str(), Total{seconds, 1});
+}
+
+void CompileTelemetry::addIRSize(const llvm::Module& module, bool optimized)
+{
+    IRSize size;
+    for (const llvm::Function& function : module) {
+        size.instructions += function.getInstructionCount();
+        size.blocks += function.size();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    IRSize& total = optimized ? afterOptimization : beforeOptimization;
+    total.instructions += size.instructions;
+    total.blocks += size.blocks;
+}
+
+void CompileTelemetry::addObject(llvm::MemoryBufferRef object)
+{
+    // Only what lands in executable sections, not relocations or symbols
+    uint64_t code = 0;
+    auto file = llvm::object::ObjectFile::createObjectFile(object);
+    if (file) {
+        for (const llvm::object::SectionRef& section : (*file)->sections()) {
+            if (section.isText()) {
+                code += section.getSize();
+            }
+        }
+    } else {
+        llvm::consumeError(file.takeError());
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    objectBytes += object.getBufferSize();
+    machineCodeBytes += code;
+}
+
+void CompileTelemetry::addCacheHit()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    cacheHits++;
+}
+
+void CompileTelemetry::setProgram(uint64_t words, uint64_t regionCount)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    programWords = words;
+    regions = regionCount;
+}
+
+void CompileTelemetry::setTarget(const std::string& triple, const std::string& cpu,
+                                 const std::string& features)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->triple = triple;
+    this->cpu = cpu;
+    this->features = features;
+}
+
+void CompileTelemetry::instrument(llvm::PassInstrumentationCallbacks& callbacks)
+{
+    // Managers and adaptors only wrap the passes that do the work
+    static const std::vector<llvm::StringRef> wrappers = {
+        "PassManager",
+        "PassAdaptor",
+    };
+
+    // Passes nest inside their adaptors, within this one pipeline
+    auto passStarts = std::make_shared<std::vector<Clock::time_point>>();
+    callbacks.registerBeforeNonSkippedPassCallback(
+        [passStarts](llvm::StringRef pass, llvm::Any) {
+            if (!llvm::isSpecialPass(pass, wrappers)) {
+                passStarts->push_back(now());
+            }
+        });
+
+    auto after = [this, passStarts](llvm::StringRef pass) {
+        if (llvm::isSpecialPass(pass, wrappers) || passStarts->empty()) {
+            return;
+        }
+        double seconds = since(passStarts->back());
+        passStarts->pop_back();
+        addPassTime(pass, seconds);
+    };
+    callbacks.registerAfterPassCallback(
+        [after](llvm::StringRef pass, llvm::Any, const llvm::PreservedAnalyses&) {
+            after(pass);
+        });
+    callbacks.registerAfterPassInvalidatedCallback(
+        [after](llvm::StringRef pass, const llvm::PreservedAnalyses&) {
+            after(pass);
+        });
+}
+
+void CompileTelemetry::print(llvm::raw_ostream& out) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    out << "===== Compile time report =====\n";
+    out << llvm::format("program: %llu words in %llu regions\n",
+                        (unsigned long long)programWords, (unsigned long long)regions);
+    out << "target: " << triple << ", cpu " << cpu << "\n";
+
+    out << "phase                               seconds    count\n";
+    for (unsigned phase = 0; phase < COMPILE_PHASES; phase++) {
+        out << llvm::format("%-32s %10.4f %8llu\n", phaseNames[phase],
+                            phases[phase].seconds,
+                            (unsigned long long)phases[phase].count);
+    }
+
+    out << "pass                                seconds    count\n";
+    for (const auto& [name, total] : passes) {
+        out << llvm::format("%-32s %10.4f %8llu\n", name.c_str(), total.seconds,
+                            (unsigned long long)total.count);
+    }
+
+    out << llvm::format("IR instructions: %llu before optimization, %llu after\n",
+                        (unsigned long long)beforeOptimization.instructions,
+                        (unsigned long long)afterOptimization.instructions);
+    out << llvm::format("IR blocks: %llu before optimization, %llu after\n",
+                        (unsigned long long)beforeOptimization.blocks,
+                        (unsigned long long)afterOptimization.blocks);
+    out << llvm::format("machine code: %llu bytes in %llu bytes of objects, %llu cache hits\n",
+                        (unsigned long long)machineCodeBytes,
+                        (unsigned long long)objectBytes,
+                        (unsigned long long)cacheHits);
+}
+
+void CompileTelemetry::writeJSON(llvm::raw_ostream& out) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    llvm::json::OStream json(out, 2);
+
+    auto writeSize = [&](const char* name, const IRSize& size) {
+        json.attributeObject(name, [&] {
+            json.attribute("instructions", (int64_t)size.instructions);
+            json.attribute("blocks", (int64_t)size.blocks);
+        });
+    };
+
+    json.object([&] {
+        json.attributeObject("program", [&] {
+            json.attribute("words", (int64_t)programWords);
+            json.attribute("regions", (int64_t)regions);
+        });
+        json.attributeObject("target", [&] {
+            json.attribute("triple", triple);
+            json.attribute("cpu", cpu);
+            json.attribute("features", features);
+        });
+        json.attributeObject("phases", [&] {
+            for (unsigned phase = 0; phase < COMPILE_PHASES; phase++) {
+                json.attributeObject(phaseNames[phase], [&] {
+                    json.attribute("seconds", phases[phase].seconds);
+                    json.attribute("count", (int64_t)phases[phase].count);
+                });
+            }
+        });
+        json.attributeArray("passes", [&] {
+            for (const auto& [name, total] : passes) {
+                json.object([&] {
+                    json.attribute("name", name);
+                    json.attribute("seconds", total.seconds);
+                    json.attribute("count", (int64_t)total.count);
+                });
+            }
+        });
+        json.attributeObject("ir", [&] {
+            writeSize("before", beforeOptimization);
+            writeSize("after", afterOptimization);
+        });
+        json.attributeObject("code", [&] {
+            json.attribute("object_bytes", (int64_t)objectBytes);
+            json.attribute("machine_code_bytes", (int64_t)machineCodeBytes);
+            json.attribute("cache_hits", (int64_t)cacheHits);
+        });
+    });
+    out << "\n";
+}
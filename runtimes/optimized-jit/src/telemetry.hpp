@@ -0,0 +1,84 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/Support/MemoryBufferRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+/* Where compile time goes, in the order a program passes through */
+enum CompilePhase {
+    PHASE_DECODE = 0,   /* ProgramLoader::load_file */
+    PHASE_BUILD,        /* Translating UM words into IR */
+    PHASE_OPTIMIZE,     /* The pass pipeline, broken down by pass below */
+    PHASE_CODEGEN,      /* IR to machine code */
+    PHASE_LINK,         /* Linking objects into the JIT, or into an executable */
+    COMPILE_PHASES
+};
+
+/* Times and sizes for every module the compiler builds, summed over the run,
+ * for --time-passes. Codegen and linking happen on compile threads, so
+ * everything here may be added to from any thread. */
+class CompileTelemetry {
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Total {
+            double seconds = 0;
+            uint64_t count = 0;
+        };
+
+        struct IRSize {
+            uint64_t instructions = 0;
+            uint64_t blocks = 0;
+        };
+
+        mutable std::mutex mutex;
+
+        Total phases[COMPILE_PHASES];
+        // In the order the passes first ran
+        std::vector<std::pair<std::string, Total>> passes;
+
+        IRSize beforeOptimization;
+        IRSize afterOptimization;
+        uint64_t objectBytes = 0;
+        uint64_t machineCodeBytes = 0;
+        uint64_t cacheHits = 0;
+
+        uint64_t programWords = 0;
+        uint64_t regions = 0;
+        std::string triple;
+        std::string cpu;
+        std::string features;
+
+        void addPassTime(llvm::StringRef pass, double seconds);
+
+    public:
+        static Clock::time_point now() { return Clock::now(); }
+        static double since(Clock::time_point start);
+
+        void addTime(CompilePhase phase, double seconds);
+
+        // Counts a module's IR as built, or as it is after the pipeline
+        void addIRSize(const llvm::Module& module, bool optimized);
+        // Counts an object from codegen, and the machine code in it
+        void addObject(llvm::MemoryBufferRef object);
+        void addCacheHit();
+
+        void setProgram(uint64_t words, uint64_t regionCount);
+        void setTarget(const std::string& triple, const std::string& cpu,
+                       const std::string& features);
+
+        // Times each pass a pass manager runs with these callbacks. Pipelines
+        // on other threads each need callbacks of their own.
+        void instrument(llvm::PassInstrumentationCallbacks& callbacks);
+
+        // A table in the style of -time-passes, or the same as one JSON object
+        void print(llvm::raw_ostream& out) const;
+        void writeJSON(llvm::raw_ostream& out) const;
+};
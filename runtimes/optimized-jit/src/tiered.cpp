@@ -0,0 +1,247 @@
+#include "tiered.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+TieredRuntime::TieredRuntime(Compiler& compiler, unsigned threshold, Profile* profile)
+    : compiler(compiler), threshold(threshold), profile(profile)
+{
+}
+
+TieredRuntime::~TieredRuntime()
+{
+    stopWorker();
+}
+
+void TieredRuntime::resetTables()
+{
+    size_t numRegions = compiler.numRegions();
+    programSize = compiler.programSize();
+
+    compiled = std::make_unique<std::atomic<RegionFunction>[]>(numRegions);
+    versions = std::make_unique<std::atomic<uint32_t>[]>(numRegions);
+    for (size_t region = 0; region < numRegions; region++) {
+        compiled[region].store(nullptr, std::memory_order_relaxed);
+        versions[region].store(0, std::memory_order_relaxed);
+    }
+    heat.assign(numRegions, 0);
+    queued.assign(numRegions, false);
+    missed.clear();
+}
+
+RegionFunction TieredRuntime::entryFor(uint32_t pc)
+{
+    size_t region = pc >> REGION_SHIFT;
+    RegionFunction function = compiled[region].load(std::memory_order_acquire);
+    if (!function || missed.empty()) {
+        return function;
+    }
+
+    // A miss holds until a newer version of its region is out
+    auto miss = missed.find(pc);
+    if (miss == missed.end()) {
+        return function;
+    }
+    if (versions[region].load(std::memory_order_acquire) == miss->second) {
+        return nullptr;
+    }
+    missed.erase(miss);
+    return compiled[region].load(std::memory_order_acquire);
+}
+
+bool TieredRuntime::onGoto(uint32_t target)
+{
+    // Let run() report gotos outside the program
+    if (target >= programSize) {
+        return true;
+    }
+
+    if (entryFor(target)) {
+        return true;
+    }
+    warm(target);
+    return false;
+}
+
+void TieredRuntime::warm(uint32_t target)
+{
+    // The goto that makes a region hot is likely the back edge of the loop
+    // keeping it busy, so its target is where compiled code is entered
+    size_t region = target >> REGION_SHIFT;
+    if (threshold > 0 && !queued[region] && ++heat[region] >= threshold) {
+        queued[region] = true;
+        enqueue(region, target, false);
+    }
+}
+
+void TieredRuntime::enqueue(size_t region, uint32_t leader, bool rebuild)
+{
+    RegionProfile counts = profile ? profile->region(region) : RegionProfile();
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        queue.push_back({region, generation, leader, rebuild, std::move(counts)});
+    }
+    queueReady.notify_one();
+}
+
+void TieredRuntime::noteMiss(uint32_t pc)
+{
+    // Interpret from here and have the region rebuilt with pc as a leader.
+    // Other entries into the region keep running the code it has.
+    size_t region = pc >> REGION_SHIFT;
+    missed[pc] = versions[region].load(std::memory_order_acquire);
+    enqueue(region, pc, true);
+}
+
+llvm::Error TieredRuntime::reload(const UMState& state)
+{
+    std::lock_guard<std::mutex> compileLock(compileMutex);
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        generation++;
+        queue.clear();
+    }
+
+    // Nothing compiled for the old program runs again
+    if (auto err = compiler.discardProgram()) {
+        return err;
+    }
+    compiler.reloadProgram(state);
+    if (auto err = compiler.addProgram()) {
+        return err;
+    }
+    resetTables();
+    return llvm::Error::success();
+}
+
+void TieredRuntime::workerLoop()
+{
+    while (true) {
+        // Take a job for each compile thread, so they all have work
+        std::vector<Job> jobs;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueReady.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
+            }
+            while (!queue.empty() && jobs.size() < compiler.compileThreads()) {
+                jobs.push_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+        }
+
+        std::lock_guard<std::mutex> compileLock(compileMutex);
+        std::vector<size_t> regions;
+        for (Job& job : jobs) {
+            if (job.generation != generation) {
+                continue;
+            }
+
+            // Wherever the interpreter went into the region, it may hand
+            // over to compiled code
+            compiler.addLeader(job.leader);
+            for (auto& [target, count] : job.profile.entries) {
+                compiler.addLeader(target);
+            }
+
+            if (profile) {
+                compiler.setRegionProfile(job.region, std::move(job.profile));
+            }
+
+            if (job.rebuild) {
+                if (auto err = compiler.redefineRegion(job.region)) {
+                    std::cerr << "Failed to redefine UM region: "
+                              << toString(std::move(err)) << std::endl;
+                    continue;
+                }
+            }
+
+            // A miss can queue a region again; one compile covers both
+            if (std::find(regions.begin(), regions.end(), job.region) == regions.end()) {
+                regions.push_back(job.region);
+            }
+        }
+        if (regions.empty()) {
+            continue;
+        }
+
+        auto err = compiler.compileRegions(
+            regions,
+            [this](size_t region, RegionFunction function) {
+                compiled[region].store(function, std::memory_order_release);
+                versions[region].fetch_add(1, std::memory_order_release);
+            }
+        );
+        if (err) {
+            // Those regions just stay in the interpreter
+            std::cerr << "Failed to compile UM region: "
+                      << toString(std::move(err)) << std::endl;
+        }
+    }
+}
+
+void TieredRuntime::stopWorker()
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stopping = true;
+    }
+    queueReady.notify_one();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+llvm::Error TieredRuntime::run()
+{
+    {
+        std::lock_guard<std::mutex> compileLock(compileMutex);
+        if (auto err = compiler.addProgram()) {
+            return err;
+        }
+        resetTables();
+    }
+    worker = std::thread(&TieredRuntime::workerLoop, this);
+
+    UMState state = {};
+    UMExit exit = interpret(state, *this, profile);
+
+    while (exit != UM_EXIT_HALT) {
+        if (exit == UM_EXIT_RELOAD) {
+            if (auto err = reload(state)) {
+                stopWorker();
+                return err;
+            }
+            exit = interpret(state, *this, profile);
+            continue;
+        }
+
+        if (state.pc >= programSize) {
+            stopWorker();
+            return llvm::make_error<llvm::StringError>(
+                "goto outside of segment 0: " + std::to_string(state.pc),
+                llvm::inconvertibleErrorCode()
+            );
+        }
+
+        // A goto landed somewhere: run it compiled if we can
+        RegionFunction function = entryFor(state.pc);
+        if (!function) {
+            // Compiled code leaving for a region counts towards it as well,
+            // or a region only ever entered that way would never get hot
+            warm(state.pc);
+            exit = interpret(state, *this, profile);
+            continue;
+        }
+
+        exit = static_cast<UMExit>(function(&state));
+        if (exit == UM_EXIT_MISS) {
+            noteMiss(state.pc);
+            exit = interpret(state, *this, profile);
+        }
+    }
+
+    stopWorker();
+    return llvm::Error::success();
+}
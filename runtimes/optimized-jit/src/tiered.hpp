@@ -0,0 +1,89 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "compiler.hpp"
+#include "interpreter.hpp"
+#include "um_state.hpp"
+
+/* Runs a program in the interpreter straight away while a background thread
+ * compiles the regions gotos keep landing in. Control moves to compiled code
+ * at the next goto into a region once it is ready, and back whenever
+ * compiled code leaves for a region that is not. Both tiers run on this
+ * thread over the same arena and UMState.
+ *
+ * Every UM loop closes with a goto, so a loop the interpreter is in moves to
+ * compiled code on its next iteration, entering with the full state at the
+ * goto target. Each target the interpreter was taking into a region is made
+ * a leader before the region is compiled, so that entry exists. A target
+ * compiled code turns out not to have is avoided until the region is
+ * rebuilt with it, while the rest of the region stays compiled.
+ *
+ * The worker owns the Compiler while it holds compileMutex. This thread only
+ * takes it to replace the program after a load program. With several compile
+ * threads, the worker hands the Compiler as many queued regions at a time.
+ *
+ * With a profile, the interpreter counts what it runs and each job carries a
+ * snapshot of its region's counts, so the worker never reads the live profile
+ * and regions are compiled with branch weights for how they actually ran. */
+class TieredRuntime : public GotoObserver {
+    private:
+        struct Job {
+            size_t region;
+            uint64_t generation;
+            uint32_t leader;    // Where the interpreter needs to enter
+            bool rebuild;       // After a miss, so the region already has code
+            RegionProfile profile;  // Counts as of the request
+        };
+
+        Compiler& compiler;
+        unsigned threshold;
+        Profile* profile;   // Filled in by the interpreter, if profiling
+
+        // Published by the worker, read here before every call. Versions
+        // count how many times each region has been published.
+        std::unique_ptr<std::atomic<RegionFunction>[]> compiled;
+        std::unique_ptr<std::atomic<uint32_t>[]> versions;
+
+        // Only touched by the executing thread
+        std::vector<uint32_t> heat;
+        std::vector<bool> queued;
+        size_t programSize = 0;
+        // Targets compiled code missed, and the version that missed them
+        std::unordered_map<uint32_t, uint32_t> missed;
+
+        std::mutex queueMutex;
+        std::condition_variable queueReady;
+        std::deque<Job> queue;
+        uint64_t generation = 0;
+        bool stopping = false;
+
+        std::mutex compileMutex;
+        std::thread worker;
+
+        void resetTables();
+        void enqueue(size_t region, uint32_t leader, bool rebuild);
+        void noteMiss(uint32_t pc);
+        // Counts a goto into a region still interpreted, queueing it when hot
+        void warm(uint32_t target);
+        // Compiled code that can be entered at pc, null if none yet
+        RegionFunction entryFor(uint32_t pc);
+        llvm::Error reload(const UMState& state);
+        void workerLoop();
+        void stopWorker();
+
+    public:
+        TieredRuntime(Compiler& compiler, unsigned threshold, Profile* profile = nullptr);
+        ~TieredRuntime();
+
+        bool onGoto(uint32_t target) override;
+
+        llvm::Error run();
+};
@@ -0,0 +1,25 @@
+#include "um_state.hpp"
+
+extern "C" {
+    #include "virt.h"
+}
+
+uint32_t um_segment_zero_written = 0;
+uint32_t um_segment_zero_assumed = 0;
+
+extern "C" void um_free_segment(uint32_t segment)
+{
+    vs_free(segment);
+}
+
+/* Load program with a nonzero segment: duplicate the segment into segment 0.
+ * Compiled code calls this and then returns to the driver to recompile. */
+extern "C" void um_load_program(uint32_t index)
+{
+    uint32_t *seg_addr = convert_address(usable, index, uint32_t);
+    uint32_t copy_size = seg_addr[-1];
+
+    kern_realloc(copy_size);
+    kern_memcpy(index, copy_size);
+    um_segment_zero_written = 0;
+}
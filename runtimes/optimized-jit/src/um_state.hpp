@@ -0,0 +1,43 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+/* The program is split into regions of 2^REGION_SHIFT words. Each region is
+ * its own function, translated and compiled the first time it is called. */
+#define REGION_SHIFT 12
+#define REGION_WORDS ((size_t)1 << REGION_SHIFT)
+
+/* The UM machine state shared between compiled code and the runtime driver.
+ * Compiled code loads the registers on entry and writes them back whenever
+ * it hands control back to the driver. */
+struct UMState {
+    uint32_t regs[8];
+    uint32_t pc;
+};
+
+/* Reasons compiled code returns to the driver */
+enum UMExit : uint32_t {
+    UM_EXIT_HALT = 0,
+    UM_EXIT_MISS = 1,   /* goto target that has no block of its own */
+    UM_EXIT_RELOAD = 2, /* segment 0 was replaced or written */
+    UM_EXIT_JUMP = 3,   /* goto into another region, handled by main */
+};
+
+/* A compiled region; returns one of the exits above */
+typedef uint32_t (*RegionFunction)(UMState* state);
+
+/* Load program from a nonzero segment, shared by both execution tiers */
+extern "C" void um_load_program(uint32_t index);
+
+/* vs_free is static inline in virt.h, so compiled code that falls back to it
+ * calls this out of line copy instead */
+extern "C" void um_free_segment(uint32_t segment);
+
+/* Set by either tier the first time the program stores into segment 0, after
+ * which it returns UM_EXIT_RELOAD so code that treated segment 0 as constant
+ * is thrown away. Cleared when load program brings in a new segment 0. */
+extern "C" uint32_t um_segment_zero_written;
+
+/* Whether the code compiled for the current segment 0 treats it as constant.
+ * If not, the interpreter notes the first store into it and carries on. */
+extern "C" uint32_t um_segment_zero_assumed;
@@ -0,0 +1,368 @@
+#include "virt_ir.hpp"
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+
+extern "C" {
+    #include "virt.h"
+}
+
+static llvm::Function* createHelper(llvm::Module& module, const std::string& name,
+                                    llvm::Type* result)
+{
+    llvm::LLVMContext& context = module.getContext();
+    llvm::FunctionType* type = llvm::FunctionType::get(
+        result,
+        {llvm::PointerType::getUnqual(context), llvm::Type::getInt32Ty(context)},
+        false
+    );
+    llvm::Function* function = llvm::Function::Create(
+        type,
+        llvm::Function::InternalLinkage,
+        name,
+        module
+    );
+    function->addFnAttr(llvm::Attribute::AlwaysInline);
+    function->addFnAttr(llvm::Attribute::NoUnwind);
+    return function;
+}
+
+static llvm::Function* defineCalloc(llvm::Module& module, llvm::GlobalVariable* recPtr,
+                                    llvm::GlobalVariable* recCleanPtr,
+                                    llvm::GlobalVariable* zeroingPtr,
+                                    llvm::GlobalVariable* startUnusedPtr,
+                                    llvm::GlobalVariable* largeStartPtr)
+{
+    llvm::LLVMContext& context = module.getContext();
+    llvm::Type* i32 = llvm::Type::getInt32Ty(context);
+    llvm::Type* i8 = llvm::Type::getInt8Ty(context);
+    llvm::Type* ptr = llvm::PointerType::getUnqual(context);
+
+    // The C best fit, for when the size's own bucket is empty, which it
+    // always is for large segments
+    llvm::FunctionCallee splitFreed = module.getOrInsertFunction(
+        "split_freed_segment",
+        llvm::FunctionType::get(i32, {ptr, i32, ptr}, false)
+    );
+
+    // And for when the unused heap runs out
+    llvm::FunctionCallee reclaim = module.getOrInsertFunction(
+        "reclaim_segment",
+        llvm::FunctionType::get(i32, {ptr, i32, ptr}, false)
+    );
+
+    // And for zeroing a segment whose pages were dropped
+    llvm::FunctionCallee zeroDropped = module.getOrInsertFunction(
+        "zero_dropped_segment",
+        llvm::FunctionType::get(llvm::Type::getVoidTy(context), {ptr, i32, i32}, false)
+    );
+
+    // And for taking a segment the background zeroer has cleared
+    llvm::FunctionCallee popClean = module.getOrInsertFunction(
+        "pop_clean_segment",
+        llvm::FunctionType::get(i32, {i32}, false)
+    );
+
+    llvm::Function* function = createHelper(module, "um_vs_calloc", i32);
+    llvm::Value* usableMem = function->getArg(0);
+    llvm::Value* size = function->getArg(1);
+    usableMem->setName("usable");
+    size->setName("size");
+
+    llvm::BasicBlock* entry = llvm::BasicBlock::Create(context, "entry", function);
+    llvm::BasicBlock* zeroing = llvm::BasicBlock::Create(context, "zeroing", function);
+    llvm::BasicBlock* clean = llvm::BasicBlock::Create(context, "clean", function);
+    llvm::BasicBlock* lookup = llvm::BasicBlock::Create(context, "lookup", function);
+    llvm::BasicBlock* recycled = llvm::BasicBlock::Create(context, "recycled", function);
+    llvm::BasicBlock* dirty = llvm::BasicBlock::Create(context, "dirty", function);
+    llvm::BasicBlock* dropped = llvm::BasicBlock::Create(context, "dropped", function);
+    llvm::BasicBlock* split = llvm::BasicBlock::Create(context, "split", function);
+    llvm::BasicBlock* fitted = llvm::BasicBlock::Create(context, "fitted", function);
+    llvm::BasicBlock* fresh = llvm::BasicBlock::Create(context, "fresh", function);
+    llvm::BasicBlock* carve = llvm::BasicBlock::Create(context, "carve", function);
+    llvm::BasicBlock* exhausted = llvm::BasicBlock::Create(context, "exhausted", function);
+    llvm::IRBuilder<> builder(entry);
+
+    // find_freed_segment: one free list per number of 32 byte blocks
+    llvm::Value* index = builder.CreateLShr(
+        builder.CreateAdd(size, builder.getInt32(BOOK_SIZE - 1)),
+        5,
+        "bucket"
+    );
+    llvm::Value* index64 = builder.CreateZExt(index, builder.getInt64Ty());
+    llvm::Value* zeroingOn = builder.CreateLoad(i8, zeroingPtr, "background_zeroing");
+    builder.CreateCondBr(builder.CreateICmpNE(zeroingOn, builder.getInt8(0), "zeroing_on"),
+                         zeroing, lookup,
+                         llvm::MDBuilder(context).createBranchWeights(1, 1000));
+
+    // Prefer a segment the zeroer has already cleared. Its list is pushed to
+    // from the zeroer's thread, so its head is read atomically.
+    builder.SetInsertPoint(zeroing);
+    llvm::Value* cleanHead = builder.CreateAlignedLoad(
+        i32,
+        builder.CreateInBoundsGEP(i32, builder.CreateLoad(ptr, recCleanPtr, "rec_clean"),
+                                  index64, "clean_head_ptr"),
+        llvm::Align(4),
+        "clean_head"
+    );
+    llvm::cast<llvm::LoadInst>(cleanHead)->setAtomic(llvm::AtomicOrdering::Monotonic);
+    builder.CreateCondBr(builder.CreateICmpEQ(cleanHead, builder.getInt32(0), "none_clean"),
+                         lookup, clean);
+
+    builder.SetInsertPoint(clean);
+    builder.CreateRet(builder.CreateCall(popClean, {size}));
+
+    builder.SetInsertPoint(lookup);
+    llvm::Value* recycler = builder.CreateLoad(ptr, recPtr, "rec");
+    llvm::Value* headPtr = builder.CreateInBoundsGEP(i32, recycler, index64, "head_ptr");
+    llvm::Value* segment = builder.CreateLoad(i32, headPtr, "segment");
+    builder.CreateCondBr(builder.CreateICmpEQ(segment, builder.getInt32(0), "empty"),
+                         split, recycled);
+
+    // Reuse the most recently freed segment of this size, zeroed, and pop
+    // the list to the next one, whose offset it holds
+    builder.SetInsertPoint(recycled);
+    llvm::Value* segmentPtr = builder.CreateInBoundsGEP(
+        i8, usableMem, builder.CreateZExt(segment, builder.getInt64Ty()), "segment_ptr"
+    );
+    builder.CreateStore(builder.CreateLoad(i32, segmentPtr, "next"), headPtr);
+    llvm::Value* tagPtr = builder.CreateConstInBoundsGEP1_64(i32, segmentPtr, -1);
+    llvm::Value* tag = builder.CreateLoad(i32, tagPtr, "tag");
+    builder.CreateStore(size, tagPtr);
+    builder.CreateCondBr(builder.CreateICmpEQ(tag, builder.getInt32(SEG_DROPPED), "was_dropped"),
+                         dropped, dirty,
+                         llvm::MDBuilder(context).createBranchWeights(1, 1000));
+
+    // clear_recycled: most segments are zeroed in full
+    builder.SetInsertPoint(dirty);
+    builder.CreateMemSet(segmentPtr, builder.getInt8(0),
+                         builder.CreateZExt(size, builder.getInt64Ty()), llvm::MaybeAlign(4));
+    builder.CreateRet(segment);
+
+    // but those whose pages were dropped only around the dropped pages
+    builder.SetInsertPoint(dropped);
+    llvm::Value* cap = builder.CreateLoad(
+        i32, builder.CreateConstInBoundsGEP1_64(i32, segmentPtr, -2), "cap"
+    );
+    builder.CreateCall(zeroDropped, {segmentPtr, cap, size});
+    builder.CreateRet(segment);
+
+    // Otherwise split a larger one
+    builder.SetInsertPoint(split);
+    llvm::Value* splitSegment = builder.CreateCall(splitFreed, {usableMem, size, recycler},
+                                                   "split_segment");
+    builder.CreateCondBr(
+        builder.CreateICmpEQ(splitSegment, builder.getInt32(SEG_NOT_FOUND), "not_found"),
+        fresh,
+        fitted
+    );
+    builder.SetInsertPoint(fitted);
+    builder.CreateRet(splitSegment);
+
+    // Otherwise carve a new one off the end of the heap, which is still zero,
+    // as long as it stays below the large segments
+    builder.SetInsertPoint(fresh);
+    llvm::Value* startUnused = builder.CreateLoad(i32, startUnusedPtr, "start_unused");
+    llvm::Value* largeStart = builder.CreateLoad(i32, largeStartPtr, "large_start");
+    llvm::Value* userCap = builder.CreateSub(
+        builder.CreateShl(builder.CreateAdd(index, builder.getInt32(1)), 5),
+        builder.getInt32(BOOK_SIZE),
+        "user_cap"
+    );
+    llvm::Value* end = builder.CreateAdd(
+        builder.CreateZExt(startUnused, builder.getInt64Ty()),
+        builder.CreateZExt(builder.CreateAdd(userCap, builder.getInt32(BOOK_SIZE)),
+                           builder.getInt64Ty()),
+        "end"
+    );
+    builder.CreateCondBr(builder.CreateICmpUGT(end, builder.CreateZExt(largeStart, builder.getInt64Ty()),
+                                               "full"),
+                         exhausted, carve,
+                         llvm::MDBuilder(context).createBranchWeights(1, 1 << 20));
+
+    builder.SetInsertPoint(exhausted);
+    builder.CreateRet(builder.CreateCall(reclaim, {usableMem, size, recycler}));
+
+    builder.SetInsertPoint(carve);
+    llvm::Value* userStart = builder.CreateAdd(startUnused, builder.getInt32(BOOK_SIZE), "user_start");
+    builder.CreateStore(builder.CreateAdd(userStart, userCap), startUnusedPtr);
+    llvm::Value* userPtr = builder.CreateInBoundsGEP(
+        i8, usableMem, builder.CreateZExt(userStart, builder.getInt64Ty()), "user_ptr"
+    );
+    builder.CreateStore(userCap, builder.CreateConstInBoundsGEP1_64(i32, userPtr, -2));
+    builder.CreateStore(size, builder.CreateConstInBoundsGEP1_64(i32, userPtr, -1));
+    builder.CreateRet(userStart);
+
+    return function;
+}
+
+static llvm::Function* defineFree(llvm::Module& module, llvm::GlobalVariable* recPtr,
+                                  llvm::GlobalVariable* recBitsPtr,
+                                  llvm::GlobalVariable* pageZeroMinPtr,
+                                  llvm::GlobalVariable* zeroingPtr)
+{
+    llvm::LLVMContext& context = module.getContext();
+    llvm::Type* i32 = llvm::Type::getInt32Ty(context);
+    llvm::Type* i8 = llvm::Type::getInt8Ty(context);
+    llvm::Type* i64 = llvm::Type::getInt64Ty(context);
+    llvm::Type* ptr = llvm::PointerType::getUnqual(context);
+
+    // The C version, which gives large segments back to the kernel, drops
+    // the pages of those past page_zero_min and queues the rest for the
+    // background zeroer
+    llvm::FunctionCallee vsFree = module.getOrInsertFunction(
+        "um_free_segment",
+        llvm::FunctionType::get(llvm::Type::getVoidTy(context), {i32}, false)
+    );
+
+    llvm::Function* function = createHelper(module, "um_vs_free", llvm::Type::getVoidTy(context));
+    llvm::Value* usableMem = function->getArg(0);
+    llvm::Value* segment = function->getArg(1);
+    usableMem->setName("usable");
+    segment->setName("segment");
+
+    llvm::BasicBlock* entry = llvm::BasicBlock::Create(context, "entry", function);
+    llvm::BasicBlock* small = llvm::BasicBlock::Create(context, "small", function);
+    llvm::BasicBlock* large = llvm::BasicBlock::Create(context, "large", function);
+    llvm::BasicBlock* mark = llvm::BasicBlock::Create(context, "mark", function);
+    llvm::BasicBlock* done = llvm::BasicBlock::Create(context, "done", function);
+    llvm::IRBuilder<> builder(entry);
+
+    // free_segment: the capacity sits two words before the segment, and the
+    // size word after it is tagged free
+    llvm::Value* segmentPtr = builder.CreateInBoundsGEP(
+        i8, usableMem, builder.CreateZExt(segment, builder.getInt64Ty()), "segment_ptr"
+    );
+    llvm::Value* cap = builder.CreateLoad(
+        i32, builder.CreateConstInBoundsGEP1_64(i32, segmentPtr, -2), "cap"
+    );
+    llvm::Value* pageZeroMin = builder.CreateLoad(i32, pageZeroMinPtr, "page_zero_min");
+    llvm::Value* zeroingOn = builder.CreateLoad(i8, zeroingPtr, "background_zeroing");
+    llvm::Value* inC = builder.CreateOr(
+        builder.CreateOr(builder.CreateICmpUGE(cap, pageZeroMin, "drop_pages"),
+                         builder.CreateICmpUGT(cap, builder.getInt32(MAX_ALLOC), "large")),
+        builder.CreateICmpNE(zeroingOn, builder.getInt8(0)),
+        "in_c"
+    );
+    builder.CreateCondBr(inC,
+                         large, small,
+                         llvm::MDBuilder(context).createBranchWeights(1, 1000));
+
+    builder.SetInsertPoint(large);
+    builder.CreateCall(vsFree, {segment});
+    builder.CreateRetVoid();
+
+    builder.SetInsertPoint(small);
+    builder.CreateStore(builder.getInt32(SEG_FREE),
+                        builder.CreateConstInBoundsGEP1_64(i32, segmentPtr, -1));
+    llvm::Value* index = builder.CreateSub(
+        builder.CreateLShr(builder.CreateAdd(cap, builder.getInt32(BOOK_SIZE)), 5),
+        builder.getInt32(1),
+        "bucket"
+    );
+    llvm::Value* recycler = builder.CreateLoad(ptr, recPtr, "rec");
+    llvm::Value* headPtr = builder.CreateInBoundsGEP(
+        i32, recycler, builder.CreateZExt(index, builder.getInt64Ty()), "head_ptr"
+    );
+
+    // Push it: the segment's first word links to the old head
+    llvm::Value* head = builder.CreateLoad(i32, headPtr, "head");
+    builder.CreateStore(head, segmentPtr);
+    builder.CreateStore(segment, headPtr);
+    builder.CreateCondBr(builder.CreateICmpEQ(head, builder.getInt32(0), "was_empty"),
+                         mark, done);
+
+    // recycler_mark: the bucket's bit at each level of the occupancy bitmap
+    builder.SetInsertPoint(mark);
+    llvm::Value* bits = builder.CreateLoad(ptr, recBitsPtr, "rec_bits");
+    llvm::Value* index64 = builder.CreateZExt(index, i64);
+    const std::pair<uint64_t, unsigned> levels[] = {
+        {REC_BITS_L0, 0},
+        {REC_BITS_L1, 6},
+        {REC_BITS_L2, 12},
+    };
+    for (const auto& [offset, shift] : levels) {
+        llvm::Value* wordPtr = builder.CreateInBoundsGEP(
+            i64, bits,
+            builder.CreateAdd(builder.CreateLShr(index64, shift + 6), builder.getInt64(offset))
+        );
+        llvm::Value* bit = builder.CreateShl(
+            builder.getInt64(1),
+            builder.CreateAnd(builder.CreateLShr(index64, shift), 63)
+        );
+        builder.CreateStore(builder.CreateOr(builder.CreateLoad(i64, wordPtr), bit), wordPtr);
+    }
+    builder.CreateBr(done);
+
+    builder.SetInsertPoint(done);
+    builder.CreateRetVoid();
+
+    return function;
+}
+
+VirtFunctions defineVirtFunctions(llvm::Module& module)
+{
+    llvm::LLVMContext& context = module.getContext();
+
+    // The recycler, its bitmap, both heap frontiers, the page cut-over and
+    // the background zeroer's lists live in virt.c
+    llvm::GlobalVariable* recPtr = new llvm::GlobalVariable(
+        module,
+        llvm::PointerType::getUnqual(context),
+        false,
+        llvm::GlobalValue::ExternalLinkage,
+        nullptr,
+        "rec"
+    );
+    llvm::GlobalVariable* recBitsPtr = new llvm::GlobalVariable(
+        module,
+        llvm::PointerType::getUnqual(context),
+        false,
+        llvm::GlobalValue::ExternalLinkage,
+        nullptr,
+        "rec_bits"
+    );
+    llvm::GlobalVariable* pageZeroMinPtr = new llvm::GlobalVariable(
+        module,
+        llvm::Type::getInt32Ty(context),
+        false,
+        llvm::GlobalValue::ExternalLinkage,
+        nullptr,
+        "page_zero_min"
+    );
+    llvm::GlobalVariable* recCleanPtr = new llvm::GlobalVariable(
+        module,
+        llvm::PointerType::getUnqual(context),
+        false,
+        llvm::GlobalValue::ExternalLinkage,
+        nullptr,
+        "rec_clean"
+    );
+    llvm::GlobalVariable* zeroingPtr = new llvm::GlobalVariable(
+        module,
+        llvm::Type::getInt8Ty(context),
+        false,
+        llvm::GlobalValue::ExternalLinkage,
+        nullptr,
+        "background_zeroing"
+    );
+    llvm::GlobalVariable* startUnusedPtr = new llvm::GlobalVariable(
+        module,
+        llvm::Type::getInt32Ty(context),
+        false,
+        llvm::GlobalValue::ExternalLinkage,
+        nullptr,
+        "start_unused"
+    );
+    llvm::GlobalVariable* largeStartPtr = new llvm::GlobalVariable(
+        module,
+        llvm::Type::getInt32Ty(context),
+        false,
+        llvm::GlobalValue::ExternalLinkage,
+        nullptr,
+        "large_start"
+    );
+
+    return {defineCalloc(module, recPtr, recCleanPtr, zeroingPtr, startUnusedPtr, largeStartPtr),
+            defineFree(module, recPtr, recBitsPtr, pageZeroMinPtr, zeroingPtr)};
+}
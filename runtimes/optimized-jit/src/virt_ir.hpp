@@ -0,0 +1,27 @@
+#pragma once
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+
+/* IR copies of the Virt32 allocator in virt.h, defined into each module as
+ * internal always-inline functions so map and unmap compile to a few loads
+ * and stores instead of opaque calls:
+ *   um_vs_calloc(usable, bytes) -> segment   as vs_calloc, calling
+ *                                            split_freed_segment only when
+ *                                            the size's bucket is empty, and
+ *                                            reclaim_segment when the heap
+ *                                            is used up, and
+ *                                            pop_clean_segment for segments
+ *                                            the background zeroer cleared
+ *   um_vs_free(usable, segment)              as vs_free, calling it for
+ *                                            large segments, segments that
+ *                                            drop their pages and while the
+ *                                            zeroer runs
+ * Both tiers share one arena and recycler through the C globals rec,
+ * rec_bits, rec_clean, background_zeroing, start_unused, large_start and
+ * page_zero_min, so these must change whenever virt.h does. */
+struct VirtFunctions {
+    llvm::Function* calloc;
+    llvm::Function* free;
+};
+
+VirtFunctions defineVirtFunctions(llvm::Module& module);
@@ -1,10 +1,75 @@
 #include "virt.h"
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The inline helpers in virt.h only define themselves for inlining. Calls
+ * left out of line, as at -O0, link against the definitions emitted here. */
+extern inline uint32_t get_idx_from_alloc_size(uint32_t size);
+extern inline void clear_recycled(uint32_t *seg_addr, uint32_t size);
+extern inline void recycler_mark(uint32_t index);
+extern inline uint32_t find_freed_segment(uint8_t *umem, uint32_t size, uint32_t *rec);
+extern inline void recycler_push(uint8_t *umem, uint32_t seg_addr, uint32_t *rec);
+extern inline void free_segment(uint8_t *umem, uint32_t seg_addr, uint32_t *rec);
+extern inline uint32_t get_at(uint8_t *umem, uint32_t addr);
 
 Mem_T *mem = NULL;
 uint8_t *usable = NULL;
-Stack_T *rec = NULL;
+uint32_t *rec = NULL;
+uint64_t *rec_bits = NULL;
 uint32_t start_unused;
+uint32_t large_start;
+
+uint32_t page_zero_min = PAGE_ZERO_MIN;
+
+uint32_t *rec_clean = NULL;
+bool background_zeroing = false;
+
+/* The ring between free_segment and the zeroer. Each index only ever grows
+ * and is written by one side: ring_head by the thread running the program,
+ * ring_tail by the zeroer once a segment is zeroed and published. */
+static uint32_t zero_ring[ZERO_RING_SIZE];
+static uint32_t ring_head = 0;
+static uint32_t ring_tail = 0;
+static bool zeroer_stop = false;
+static pthread_t zeroer;
+
+/* How long the zeroer sleeps when the ring is empty, doubling up to the
+ * longest while it stays empty */
+#define ZEROER_IDLE_MIN_NS 10000
+#define ZEROER_IDLE_MAX_NS 1000000
+
+static uint32_t compactions = 0;
+static uintptr_t page_size = 4096;
+
+/* Reserve a zero-filled table that the kernel only backs with pages as they
+ * are touched */
+static void *map_lazy_table(size_t bytes)
+{
+    void *table = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(table != MAP_FAILED);
+    return table;
+}
+
+/* Give whole pages back to the kernel. Linux zero-fills private anonymous
+ * pages dropped with MADV_DONTNEED on their next touch; MADV_FREE makes no
+ * such promise, and neither does MADV_DONTNEED elsewhere, where mapping
+ * fresh pages over the old ones does. */
+static void zero_pages(void *addr, size_t bytes)
+{
+#ifdef __linux__
+    madvise(addr, bytes, MADV_DONTNEED);
+#else
+    void *fresh = mmap(addr, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    assert(fresh == addr);
+    (void)fresh;
+#endif
+}
 
 uint8_t *init_memory_system(uint32_t kernel_size)
 {
@@ -28,15 +93,30 @@ uint8_t *init_memory_system(uint32_t kernel_size)
     mem->kernel_virtual_size = kernel_size - BOOK_SIZE;
     mem->begin_unused = kernel_size;
     start_unused = kernel_size;
+    large_start = (uint32_t)HEAP_END;
+    compactions = 0;
+    page_size = sysconf(_SC_PAGESIZE);
 
     return usable;
 }
 
+static void stop_background_zeroing(void);
+static uint32_t pop_clean(uint32_t index);
+static uint32_t map_large_segment(uint8_t *umem, uint32_t size, uint32_t *rec);
+
 void terminate_memory_system(void)
 {
+    if (background_zeroing)
+        stop_background_zeroing();
+
     /* Free the memory object statically defined within this file */
     munmap(mem->mem, GB4);
     free_recycler(rec);
+    free(mem);
+
+    mem = NULL;
+    usable = NULL;
+    rec = NULL;
 }
 
 /* Kernel (Re)allocate (kern_realloc):
@@ -72,43 +152,601 @@ void kern_memcpy(uint32_t src_addr, uint32_t copy_size)
     return;
 }
 
-inline Stack_T stack_init(uint32_t size)
+/* Recycler Init (recycler_init):
+ * Every bucket starts out as an empty list. The table of heads is mapped
+ * rather than malloced, so the kernel only commits the pages of it that
+ * segments are actually freed into. */
+uint32_t *recycler_init(void)
+{
+    rec_bits = map_lazy_table(sizeof(uint64_t) * REC_BITS_WORDS);
+    return map_lazy_table(sizeof(uint32_t) * REC_TABLE_ENTRIES);
+}
+
+void free_recycler(uint32_t *rec)
+{
+    /* The lists themselves live in the arena, which is already unmapped */
+    munmap(rec, sizeof(uint32_t) * REC_TABLE_ENTRIES);
+    munmap(rec_bits, sizeof(uint64_t) * REC_BITS_WORDS);
+    rec_bits = NULL;
+}
+
+/* Bits strictly above bit in a word */
+static inline uint64_t bits_above(uint64_t word, uint32_t bit)
+{
+    return word & (~(uint64_t)1 << (bit & 63));
+}
+
+/* Smallest bucket above index whose bit is set, or REC_BUCKETS. A set bit at
+ * one level always has a set bit under it at the level below. */
+static uint32_t next_marked_bucket(uint32_t index)
+{
+    uint64_t *l0 = rec_bits + REC_BITS_L0;
+    uint64_t *l1 = rec_bits + REC_BITS_L1;
+    uint64_t *l2 = rec_bits + REC_BITS_L2;
+
+    /* The rest of the bucket's own word */
+    uint32_t word = index >> 6;
+    uint64_t bits = bits_above(l0[word], index);
+    if (bits != 0)
+        return (word << 6) | __builtin_ctzll(bits);
+
+    /* The next word with a bucket in it, from the rest of its group */
+    uint32_t group = word >> 6;
+    bits = bits_above(l1[group], word);
+    if (bits == 0)
+    {
+        /* The next group with a word in it */
+        uint32_t top = group >> 6;
+        bits = bits_above(l2[top], group);
+        while (bits == 0)
+        {
+            if (++top == REC_BITS_WORDS - REC_BITS_L2)
+                return REC_BUCKETS;
+            bits = l2[top];
+        }
+
+        group = (top << 6) | __builtin_ctzll(bits);
+        bits = l1[group];
+    }
+
+    word = (group << 6) | __builtin_ctzll(bits);
+    return (word << 6) | __builtin_ctzll(l0[word]);
+}
+
+/* Clear an empty bucket's bit, and the bits above it that no longer cover
+ * any set bits */
+static void recycler_unmark(uint32_t index)
+{
+    uint64_t *l0 = rec_bits + REC_BITS_L0;
+    uint64_t *l1 = rec_bits + REC_BITS_L1;
+    uint64_t *l2 = rec_bits + REC_BITS_L2;
+
+    l0[index >> 6] &= ~((uint64_t)1 << (index & 63));
+    if (l0[index >> 6] != 0)
+        return;
+
+    l1[index >> 12] &= ~((uint64_t)1 << ((index >> 6) & 63));
+    if (l1[index >> 12] != 0)
+        return;
+
+    l2[index >> 18] &= ~((uint64_t)1 << ((index >> 12) & 63));
+}
+
+uint32_t split_freed_segment(uint8_t *umem, uint32_t size, uint32_t *rec)
+{
+    uint32_t index = get_idx_from_alloc_size(size);
+    uint32_t bucket = index;
+    uint32_t freed_seg = 0;
+    bool clean = false;
+
+    if (index >= REC_BUCKETS)
+        return map_large_segment(umem, size, rec);
+
+    while (freed_seg == 0)
+    {
+        bucket = next_marked_bucket(bucket);
+        if (bucket == REC_BUCKETS)
+            return SEG_NOT_FOUND;
+
+        freed_seg = rec[bucket];
+        if (freed_seg != 0)
+        {
+            rec[bucket] = *convert_address(umem, freed_seg, uint32_t);
+            break;
+        }
+
+        /* The zeroer's segments are marked too, from when they were queued */
+        if (background_zeroing)
+        {
+            if (__atomic_load_n(&rec_clean[bucket], __ATOMIC_RELAXED) != 0)
+            {
+                freed_seg = pop_clean(bucket);
+                clean = true;
+                break;
+            }
+
+            /* One may still be on its way, and must find its bit set */
+            if (__atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) != ring_head)
+                continue;
+        }
+        recycler_unmark(bucket);
+    }
+
+    uint32_t *freed_seg_addr = convert_address(umem, freed_seg, uint32_t);
+    uint32_t cap = freed_seg_addr[-2];
+    uint32_t tag = freed_seg_addr[-1];
+
+    /* The front keeps the blocks the size needs, and the remaining
+     * (bucket - index) blocks go back to the recycler in their own bucket.
+     * If the pages were dropped, the ones inside the rest still are. */
+    uint32_t user_cap = ((index + 1) * BLOCK_SIZE) - BOOK_SIZE;
+    uint32_t rest = freed_seg + user_cap + BOOK_SIZE;
+    uint32_t *rest_addr = convert_address(umem, rest, uint32_t);
+    rest_addr[-2] = ((bucket - index) * BLOCK_SIZE) - BOOK_SIZE;
+    rest_addr[-1] = tag;
+    recycler_push(umem, rest, rec);
+
+    freed_seg_addr[-2] = user_cap;
+    freed_seg_addr[-1] = size;
+    if (clean)
+        freed_seg_addr[0] = 0;
+    else if (tag == SEG_DROPPED)
+        zero_dropped_segment(freed_seg_addr, cap, size);
+    else
+        memset(freed_seg_addr, 0, size);
+
+    return freed_seg;
+}
+
+/* The whole pages of a segment that free_segment may drop: past its first
+ * word, which links it into its bucket, and inside its capacity */
+static void dropped_pages(uint32_t *seg_addr, uint32_t cap, uint8_t **start,
+                          uint8_t **end)
+{
+    uintptr_t first = (uintptr_t)(seg_addr + 1);
+    uintptr_t last = (uintptr_t)seg_addr + cap;
+
+    *start = (uint8_t *)((first + page_size - 1) & ~(page_size - 1));
+    *end = (uint8_t *)(last & ~(page_size - 1));
+}
+
+uint32_t drop_segment_pages(uint8_t *umem, uint32_t seg_addr, uint32_t cap)
+{
+    uint8_t *start, *end;
+    dropped_pages(convert_address(umem, seg_addr, uint32_t), cap, &start, &end);
+
+    if (start >= end)
+        return SEG_FREE;
+
+    zero_pages(start, end - start);
+    return SEG_DROPPED;
+}
+
+void zero_dropped_segment(uint32_t *seg_addr, uint32_t cap, uint32_t size)
+{
+    uint8_t *start, *end;
+    dropped_pages(seg_addr, cap, &start, &end);
+
+    /* Everything before the first dropped page, and after the last */
+    uint8_t *first = (uint8_t *)seg_addr;
+    uint8_t *last = first + size;
+
+    if (last <= start)
+    {
+        memset(first, 0, size);
+        return;
+    }
+
+    memset(first, 0, start - first);
+    if (last > end)
+        memset(end, 0, last - end);
+}
+
+/* Zero the end of the heap that coalescing gave back to the unused heap,
+ * whose fresh segments are expected to be zero already. Past start_unused
+ * it is zero, so the last partial page can be dropped whole. */
+static void zero_unused_heap(uint8_t *umem, uint64_t start, uint64_t end)
 {
-    assert(size > 0);
+    uint8_t *first = convert_address(umem, start, uint8_t);
+    uint8_t *last = convert_address(umem, end, uint8_t);
+    uint8_t *pages = (uint8_t *)(((uintptr_t)first + page_size - 1) & ~(page_size - 1));
 
-    Stack_T s;
-    s.stack = malloc(size * sizeof(uint32_t));
-    s.capacity = size;
-    s.size = 0;
+    if (last <= pages)
+    {
+        memset(first, 0, last - first);
+        return;
+    }
 
-    return s;
+    memset(first, 0, pages - first);
+    last = (uint8_t *)(((uintptr_t)last + page_size - 1) & ~(page_size - 1));
+    zero_pages(pages, last - pages);
+}
+
+/* Publish a zeroed segment on its rec_clean list. The release pairs with
+ * pop_clean_segment, so the zeros and the link are seen before the segment */
+static void push_clean_segment(uint32_t seg_addr)
+{
+    uint32_t *seg = convert_address(usable, seg_addr, uint32_t);
+    uint32_t index = ((seg[-2] + 8) / 32) - 1;
+
+    uint32_t head = __atomic_load_n(&rec_clean[index], __ATOMIC_RELAXED);
+    do
+    {
+        seg[0] = head;
+    } while (!__atomic_compare_exchange_n(&rec_clean[index], &head, seg_addr, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
 
-inline void stack_free(Stack_T s)
+/* Take the newest segment off a non-empty rec_clean list. Only the zeroer
+ * pushes and only the thread running the program pops, so a failed exchange
+ * means a newer segment was pushed, never that this one was taken. */
+static uint32_t pop_clean(uint32_t index)
 {
-    free(s.stack);
+    uint32_t head = __atomic_load_n(&rec_clean[index], __ATOMIC_ACQUIRE);
+    uint32_t *seg;
+
+    do
+    {
+        seg = convert_address(usable, head, uint32_t);
+    } while (!__atomic_compare_exchange_n(&rec_clean[index], &head, seg[0], true,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    return head;
 }
 
-Stack_T *recycler_init(void)
+/* The zeroer: drains the ring, sleeping longer and longer while it is empty.
+ * A segment only leaves the ring once it is on its list, so an empty ring
+ * means every queued segment can be found there. */
+static void *zero_segments(void *arg)
 {
-    Stack_T *recycler = malloc(sizeof(Stack_T) * REC_BUCKETS);
-    assert(recycler != NULL);
+    (void)arg;
+    uint32_t tail = ring_tail;
+    long idle = ZEROER_IDLE_MIN_NS;
 
-    for (uint32_t i = 0; i < REC_BUCKETS; i++)
+    while (!__atomic_load_n(&zeroer_stop, __ATOMIC_ACQUIRE))
     {
-        Stack_T s = stack_init(INIT_STACK_SIZE);
-        recycler[i] = s;
+        uint32_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+        if (tail == head)
+        {
+            struct timespec pause = {0, idle};
+            nanosleep(&pause, NULL);
+            if (idle < ZEROER_IDLE_MAX_NS)
+                idle *= 2;
+            continue;
+        }
+
+        idle = ZEROER_IDLE_MIN_NS;
+        while (tail != head)
+        {
+            uint32_t seg_addr = zero_ring[tail % ZERO_RING_SIZE];
+            uint32_t *seg = convert_address(usable, seg_addr, uint32_t);
+            memset(seg, 0, seg[-2]);
+            push_clean_segment(seg_addr);
+            __atomic_store_n(&ring_tail, ++tail, __ATOMIC_RELEASE);
+        }
     }
 
-    return recycler;
+    return NULL;
 }
 
-void free_recycler(Stack_T *rec)
+bool start_background_zeroing(void)
 {
-    for (uint32_t i = 0; i < REC_BUCKETS; i++)
+    assert(mem != NULL && !background_zeroing);
+    rec_clean = map_lazy_table(sizeof(uint32_t) * REC_TABLE_ENTRIES);
+    ring_head = 0;
+    ring_tail = 0;
+    zeroer_stop = false;
+
+    if (pthread_create(&zeroer, NULL, zero_segments, NULL) != 0)
     {
-        stack_free(rec[i]);
+        munmap(rec_clean, sizeof(uint32_t) * REC_TABLE_ENTRIES);
+        rec_clean = NULL;
+        return false;
     }
 
-    free(rec);
+    background_zeroing = true;
+    return true;
+}
+
+static void stop_background_zeroing(void)
+{
+    __atomic_store_n(&zeroer_stop, true, __ATOMIC_RELEASE);
+    pthread_join(zeroer, NULL);
+
+    munmap(rec_clean, sizeof(uint32_t) * REC_TABLE_ENTRIES);
+    rec_clean = NULL;
+    background_zeroing = false;
+}
+
+/* Wait for the zeroer to empty the ring, after which it touches nothing in
+ * the arena until more segments are queued */
+static void drain_zero_ring(void)
+{
+    while (__atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) != ring_head)
+        sched_yield();
+}
+
+bool zero_later(uint32_t seg_addr)
+{
+    /* The acquire makes sure the zeroer has read a slot before it is reused */
+    uint32_t head = ring_head;
+    if (head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) == ZERO_RING_SIZE)
+        return false;
+
+    /* Marked now, so split_freed_segment looks for it on rec_clean later */
+    uint32_t cap = convert_address(usable, seg_addr, uint32_t)[-2];
+    recycler_mark(((cap + 8) / 32) - 1);
+
+    zero_ring[head % ZERO_RING_SIZE] = seg_addr;
+    __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+uint32_t pop_clean_segment(uint32_t size)
+{
+    uint32_t seg_addr = pop_clean(get_idx_from_alloc_size(size));
+    uint32_t *seg = convert_address(usable, seg_addr, uint32_t);
+
+    /* Everything but the link is still zero */
+    seg[0] = 0;
+    seg[-1] = size;
+    return seg_addr;
+}
+
+/* Free a run of neighbouring segments as segments as large as the recycler
+ * has buckets for */
+static void recycle_extent(uint8_t *umem, uint64_t start, uint64_t end,
+                           uint32_t *rec)
+{
+    while (start < end)
+    {
+        uint64_t bytes = end - start;
+        if (bytes > (uint64_t)REC_BUCKETS * BLOCK_SIZE)
+            bytes = (uint64_t)REC_BUCKETS * BLOCK_SIZE;
+
+        /* Straight into the recycler, not the zeroer's ring, so that
+         * reclaim_segment can find them right away */
+        uint32_t *book = convert_address(umem, start, uint32_t);
+        uint32_t cap = bytes - BOOK_SIZE;
+        book[0] = cap;
+        if (cap >= page_zero_min)
+            book[1] = drop_segment_pages(umem, start + BOOK_SIZE, cap);
+        else
+            book[1] = SEG_FREE;
+
+        recycler_push(umem, start + BOOK_SIZE, rec);
+        start += bytes;
+    }
+}
+
+/* Coalesce Free Segments (coalesce_free_segments):
+ * Walks the heap in address order by the bookkeeping before each segment,
+ * merging every run of freed neighbours into one. The recycler is emptied
+ * and rebuilt from the merged runs, except a run that reaches start_unused,
+ * which goes back to the unused heap. */
+static void coalesce_free_segments(uint8_t *umem, uint32_t *rec)
+{
+    /* Dropping the pages zeroes every list head and bitmap word, once the
+     * zeroer has finished with the segments on the ring */
+    if (background_zeroing)
+    {
+        drain_zero_ring();
+        zero_pages(rec_clean, sizeof(uint32_t) * REC_BUCKETS);
+    }
+    zero_pages(rec, sizeof(uint32_t) * REC_BUCKETS);
+    zero_pages(rec_bits, sizeof(uint64_t) * REC_BITS_WORDS);
+
+    uint64_t addr = mem->begin_unused;
+    uint64_t run = 0;
+    bool in_run = false;
+
+    while (addr < start_unused)
+    {
+        uint32_t *book = convert_address(umem, addr, uint32_t);
+        uint64_t next = addr + BOOK_SIZE + book[0];
+
+        if (seg_is_free(book[1]) && !in_run)
+        {
+            run = addr;
+            in_run = true;
+        }
+        else if (!seg_is_free(book[1]) && in_run)
+        {
+            recycle_extent(umem, run, addr, rec);
+            in_run = false;
+        }
+
+        addr = next;
+    }
+
+    if (in_run)
+    {
+        zero_unused_heap(umem, run, start_unused);
+        start_unused = run;
+    }
+
+    compactions++;
+}
+
+uint32_t reclaim_segment(uint8_t *umem, uint32_t size, uint32_t *rec)
+{
+    coalesce_free_segments(umem, rec);
+
+    uint32_t freed_seg = find_freed_segment(umem, size, rec);
+    if (freed_seg != SEG_NOT_FOUND)
+    {
+        clear_recycled(convert_address(umem, freed_seg, uint32_t), size);
+        return freed_seg;
+    }
+
+    freed_seg = split_freed_segment(umem, size, rec);
+    if (freed_seg != SEG_NOT_FOUND)
+        return freed_seg;
+
+    uint32_t user_cap = ((get_idx_from_alloc_size(size) + 1) * BLOCK_SIZE) - BOOK_SIZE;
+    if ((uint64_t)start_unused + BOOK_SIZE + user_cap > large_start)
+    {
+        fprintf(stderr, "Virt32: out of memory mapping %u bytes\n", size);
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t user_start = start_unused + BOOK_SIZE;
+    start_unused = user_start + user_cap;
+
+    uint32_t *user_addr = convert_address(umem, user_start, uint32_t);
+    user_addr[-2] = user_cap;
+    user_addr[-1] = size;
+
+    return user_start;
+}
+
+/* Large segments:
+ * From large_start to HEAP_END, the arena is a run of page-aligned extents,
+ * each led by the usual two words of bookkeeping. Freed ones have had their
+ * pages dropped and are tagged SEG_DROPPED, so all of them but their
+ * bookkeeping is zero. At 16 MB and up there can only be a couple of hundred,
+ * so they are simply walked in address order. */
+
+/* Whole pages for a large segment of size bytes and its bookkeeping */
+static uint64_t large_extent_bytes(uint32_t size)
+{
+    return ((uint64_t)size + BOOK_SIZE + page_size - 1) & ~(uint64_t)(page_size - 1);
+}
+
+/* Merge every run of freed neighbouring extents, and give the one at the
+ * bottom back to the heap below, whose unused end must be zero. Bookkeeping
+ * that ends up inside a freed extent is cleared, as the rest of it is. */
+static void merge_large_extents(uint8_t *umem)
+{
+    uint64_t addr = large_start;
+    uint32_t *run = NULL;
+
+    while (addr < HEAP_END)
+    {
+        uint32_t *book = convert_address(umem, addr, uint32_t);
+        uint64_t next = addr + BOOK_SIZE + book[0];
+
+        if (book[1] != SEG_DROPPED)
+        {
+            run = NULL;
+        }
+        else if (run == NULL)
+        {
+            run = book;
+        }
+        else
+        {
+            run[0] += BOOK_SIZE + book[0];
+            book[0] = 0;
+            book[1] = 0;
+        }
+
+        addr = next;
+    }
+
+    uint32_t *bottom = convert_address(umem, large_start, uint32_t);
+    if (large_start < HEAP_END && bottom[1] == SEG_DROPPED)
+    {
+        large_start += BOOK_SIZE + bottom[0];
+        bottom[0] = 0;
+        bottom[1] = 0;
+    }
+}
+
+/* First fit among the freed extents, splitting off what is left over, or
+ * else a fresh extent below the rest. The heap below is compacted if it is
+ * in the way. */
+static uint32_t map_large_segment(uint8_t *umem, uint32_t size, uint32_t *rec)
+{
+    uint64_t bytes = large_extent_bytes(size);
+
+    for (uint64_t addr = large_start; addr < HEAP_END;)
+    {
+        uint32_t *book = convert_address(umem, addr, uint32_t);
+        uint64_t extent = BOOK_SIZE + book[0];
+
+        if (book[1] == SEG_DROPPED && extent >= bytes)
+        {
+            if (extent > bytes)
+            {
+                uint32_t *rest = convert_address(umem, addr + bytes, uint32_t);
+                rest[0] = extent - bytes - BOOK_SIZE;
+                rest[1] = SEG_DROPPED;
+            }
+
+            book[0] = bytes - BOOK_SIZE;
+            book[1] = size;
+            return addr + BOOK_SIZE;
+        }
+
+        addr += extent;
+    }
+
+    if ((uint64_t)start_unused + bytes > large_start)
+        coalesce_free_segments(umem, rec);
+
+    if ((uint64_t)start_unused + bytes > large_start)
+    {
+        fprintf(stderr, "Virt32: out of memory mapping %u bytes\n", size);
+        exit(EXIT_FAILURE);
+    }
+
+    large_start -= bytes;
+    uint32_t *book = convert_address(umem, large_start, uint32_t);
+    book[0] = bytes - BOOK_SIZE;
+    book[1] = size;
+    return large_start + BOOK_SIZE;
+}
+
+void free_large_segment(uint8_t *umem, uint32_t seg_addr)
+{
+    uint32_t *seg = convert_address(umem, seg_addr, uint32_t);
+    uint32_t cap = seg[-2];
+
+    /* The extent starts on a page, so it is dropped whole */
+    zero_pages(seg - 2, BOOK_SIZE + (size_t)cap);
+    seg[-2] = cap;
+    seg[-1] = SEG_DROPPED;
+
+    merge_large_extents(umem);
+}
+
+/* Virt Stats (virt_stats):
+ * Walks the heap like coalesce_free_segments, counting instead of merging */
+void virt_stats(VirtStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->heap_bytes = start_unused - mem->begin_unused;
+    stats->large_bytes = HEAP_END - large_start;
+    stats->compactions = compactions;
+
+    uint64_t addr = mem->begin_unused;
+    uint64_t run = 0;
+    bool in_run = false;
+
+    while (addr < start_unused)
+    {
+        uint32_t *book = convert_address(usable, addr, uint32_t);
+        uint64_t bytes = BOOK_SIZE + book[0];
+
+        if (seg_is_free(book[1]))
+        {
+            stats->free_bytes += bytes;
+            stats->free_segments++;
+            if (!in_run)
+            {
+                stats->free_extents++;
+                run = 0;
+                in_run = true;
+            }
+            run += bytes;
+            if (run > stats->largest_extent)
+                stats->largest_extent = run;
+        }
+        else
+        {
+            in_run = false;
+        }
+
+        addr += bytes;
+    }
 }
@@ -4,9 +4,10 @@
 #define BOOK_SIZE 8
 #define MIN_SEG_SIZE 32
 
-/* The user can allocate at most 2^24 - 8 bytes. This means there are 2^19
- * different segment lengths a user can allocate, and we are going to use a
- * unique bucket to recycle each one. */
+/* The recycler handles at most 2^24 - 8 bytes. This means there are 2^19
+ * different segment lengths it recycles, and we are going to use a unique
+ * bucket to recycle each one. Larger segments are page-aligned extents taken
+ * from the top of the arena instead. */
 #define MAX_ALLOC (((uint32_t)1 << 24) - BOOK_SIZE)
 #define KERN_SIZE MAX_ALLOC
 #define REC_BUCKETS ((uint32_t)1 << 19) /* 2^19 recyclable segment lengths */
@@ -15,35 +16,80 @@
 #define BOOK_SIZE 8
 #define BLOCK_SIZE 32
 
-#define INIT_STACK_SIZE 2
 #define SEG_NOT_FOUND 1
 
+/* The bucket indexes of sizes past MAX_ALLOC run up to here. Their list
+ * heads are never written, so they read as empty and vs_calloc sends those
+ * sizes on to split_freed_segment without a check of its own. */
+#define REC_TABLE_ENTRIES ((uint32_t)(GB4 / BLOCK_SIZE))
+
+/* Freed segments carry this in place of their size, so the heap can be
+ * walked by its boundary tags to find neighbouring free space */
+#define SEG_FREE ((uint32_t)0xFFFFFFFF)
+
+/* Or this, once the whole pages inside them were handed back to the kernel,
+ * which fills them with zeros again the next time they are touched */
+#define SEG_DROPPED ((uint32_t)0xFFFFFFFE)
+#define seg_is_free(tag) ((tag) >= SEG_DROPPED)
+
+/* Segments with at least this much capacity drop their pages on free,
+ * unless page_zero_min is set otherwise */
+#define PAGE_ZERO_MIN ((uint32_t)1 << 22)
+
+/* Freed segments waiting for the background zeroer, at most */
+#define ZERO_RING_SIZE ((uint32_t)1 << 12)
+
+/* The arena past usable, which every segment must end inside */
+#define HEAP_END (GB4 - BOOK_SIZE)
+
+/* Segments larger than MAX_ALLOC: whole pages, bookkeeping included, carved
+ * downward from HEAP_END. Below large_start is the heap of smaller ones. */
+#define seg_is_large(cap) ((cap) > MAX_ALLOC)
+
+/* Which buckets have freed segments, as a bitmap three levels deep: a bit per
+ * bucket, then a bit per word of the level below, so the next non-empty
+ * bucket is a few trailing zero counts away. All levels share one array. */
+#define REC_BITS_L0 0
+#define REC_BITS_L1 (REC_BUCKETS / 64)
+#define REC_BITS_L2 (REC_BITS_L1 + REC_BUCKETS / (64 * 64))
+#define REC_BITS_WORDS (REC_BITS_L2 + REC_BUCKETS / (64 * 64 * 64))
+
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
 
+/* Fragmentation of the heap, as counted by walking it */
 typedef struct
 {
-    uint32_t *stack;
-    uint32_t size;
-    uint32_t capacity;
-} __attribute__((packed)) Stack_T;
+    uint64_t heap_bytes;      /* From the first segment to start_unused */
+    uint64_t free_bytes;      /* In freed segments, bookkeeping included */
+    uint32_t free_segments;   /* Freed segments, neighbours counted apart */
+    uint32_t free_extents;    /* Runs of neighbouring freed segments */
+    uint64_t largest_extent;  /* The largest of those runs, in bytes */
+    uint32_t compactions;     /* Times the heap ran out and was coalesced */
+    uint64_t large_bytes;     /* From large_start to the end of the arena */
+} VirtStats;
 
 typedef struct
 {
     void *mem;        /* Pointer to the full 4GB of memory */
     void *usable_mem; /* Pointer to the beginning of usable memory */
-    void *recycler;   /* Array of stacks for recycling segments */
+    void *recycler;   /* Free list heads for recycling segments */
     uint32_t kernel_virtual_size;
     uint32_t begin_unused;
 } Mem_T;
 
 extern uint8_t *usable;
-extern Stack_T *rec;
+extern uint32_t *rec;
+extern uint64_t *rec_bits;
 extern Mem_T *mem;
 extern uint32_t start_unused;
+extern uint32_t large_start;
+extern uint32_t page_zero_min;
+extern uint32_t *rec_clean;
+extern bool background_zeroing;
 
 /* Memory utility functions */
 
@@ -69,82 +115,138 @@ inline uint32_t get_idx_from_alloc_size(uint32_t size)
     return num_blocks;
 }
 
-/* Stack interface */
-inline uint32_t stack_top(Stack_T s)
+/* Recycler functions:
+ * Freed segments of each size form a singly linked list threaded through the
+ * segments themselves. rec holds the head of each bucket's list, and the
+ * first word of every freed segment holds the next one, both as arena
+ * offsets. 0 is segment 0, which is never freed, so it ends every list. */
+uint32_t *recycler_init(void);
+
+void free_recycler(uint32_t *rec);
+
+/* Best fit for a size whose own bucket is empty: takes a segment from the
+ * smallest larger bucket, zeroes and returns the front of it, and frees the
+ * rest as a segment of its own. SEG_NOT_FOUND if all larger buckets are
+ * empty. Sizes past MAX_ALLOC have no bucket, and are mapped as large
+ * segments here. */
+uint32_t split_freed_segment(uint8_t *umem, uint32_t size, uint32_t *rec);
+
+/* Last resort for a size the unused heap cannot fit: coalesces every run of
+ * neighbouring freed segments and tries again. Exits if even that fails. */
+uint32_t reclaim_segment(uint8_t *umem, uint32_t size, uint32_t *rec);
+
+/* Give a large segment's pages back to the kernel, so it is zero when it is
+ * mapped again */
+void free_large_segment(uint8_t *umem, uint32_t seg_addr);
+
+/* Drop the whole pages inside a segment being freed, returning the tag it
+ * should carry: SEG_DROPPED, or SEG_FREE if it has no whole pages */
+uint32_t drop_segment_pages(uint8_t *umem, uint32_t seg_addr, uint32_t cap);
+
+/* Zero the first size bytes of a dropped segment with the given capacity,
+ * which only needs the partial pages around its dropped ones */
+void zero_dropped_segment(uint32_t *seg_addr, uint32_t cap, uint32_t size);
+
+/* Background zeroing:
+ * Once started, small segments are not zeroed when they are reused but by a
+ * second thread after they are freed. free_segment queues them on a ring
+ * that only it writes and the zeroer only reads, and the zeroer publishes
+ * them, zeroed, on a second set of lists, rec_clean, which only it pushes to
+ * and only the program's thread pops from: vs_calloc for an exact fit, and
+ * split_freed_segment for a larger one. Neither needs a lock. */
+bool start_background_zeroing(void);
+
+/* Queue a segment tagged free for the zeroer. False if the ring is full, in
+ * which case it belongs in the recycler as usual. */
+bool zero_later(uint32_t seg_addr);
+
+/* Pop a zeroed segment from a non-empty rec_clean list and give it its new
+ * size */
+uint32_t pop_clean_segment(uint32_t size);
+
+/* Zero a recycled segment for reuse and give it its new size */
+inline void clear_recycled(uint32_t *seg_addr, uint32_t size)
 {
-    assert(s.size > 0);
-    return s.stack[s.size - 1];
-}
+    uint32_t tag = seg_addr[-1];
+    seg_addr[-1] = size;
 
-inline Stack_T stack_push(Stack_T s, uint32_t elem)
-{
-    if (s.size == s.capacity)
-    {
-        /* Expand the stack */
-        s.capacity *= 2;
-        uint32_t *temp = VIRT_MALLOC_CAST(uint32_t*, malloc(s.capacity * sizeof(uint32_t)));
-        for (uint32_t i = 0; i < s.size; i++)
-        {
-            temp[i] = s.stack[i];
-        }
-
-        free(s.stack);
-        s.stack = temp;
-    }
-
-    s.stack[s.size++] = elem;
-    return s;
+    if (tag == SEG_DROPPED)
+        zero_dropped_segment(seg_addr, seg_addr[-2], size);
+    else
+        memset(seg_addr, 0, size);
 }
 
-inline Stack_T stack_pop(Stack_T s)
+/* A bucket's bits are set when a segment is freed into it while it is empty,
+ * or queued for the zeroer. They are only cleared by split_freed_segment,
+ * when it finds the bucket and its rec_clean list empty with nothing left on
+ * the ring, so a clear bit always means an empty bucket but a set one may
+ * not mean a full one. */
+inline void recycler_mark(uint32_t index)
 {
-    /* Omitted to improve performance:
-     * assert(s.size > 0); */
-
-    s.size--;
-    return s;
+    rec_bits[REC_BITS_L0 + (index >> 6)] |= (uint64_t)1 << (index & 63);
+    rec_bits[REC_BITS_L1 + (index >> 12)] |= (uint64_t)1 << ((index >> 6) & 63);
+    rec_bits[REC_BITS_L2 + (index >> 18)] |= (uint64_t)1 << ((index >> 12) & 63);
 }
 
-inline bool stack_is_empty(Stack_T s)
-{
-    return s.size == 0;
-}
-
-/* Recycler functions*/
-Stack_T *recycler_init(void);
-
-void free_recycler(Stack_T *rec);
-
-inline uint32_t find_freed_segment(uint32_t size, Stack_T *rec)
+inline uint32_t find_freed_segment(uint8_t *umem, uint32_t size, uint32_t *rec)
 {
     uint32_t index = get_idx_from_alloc_size(size);
 
-    /* Omitted to improve performance:
-     * assert(index < REC_BUCKETS); */
+    /* Past REC_BUCKETS, index is a large size with an always empty list */
 
-    Stack_T s = rec[index];
+    uint32_t freed_segment = rec[index];
 
     /* if no segment of size 'size', check next bucket */
-    if (stack_is_empty(s))
+    if (freed_segment == 0)
         return SEG_NOT_FOUND;
 
-    uint32_t freed_segment = stack_top(s);
-    rec[index] = stack_pop(s);
+    rec[index] = *convert_address(umem, freed_segment, uint32_t);
     return freed_segment;
 }
 
-inline void free_segment(uint8_t *umem, uint32_t seg_addr, Stack_T *rec)
+/* Link a segment that is already tagged free into its bucket */
+inline void recycler_push(uint8_t *umem, uint32_t seg_addr, uint32_t *rec)
+{
+    uint32_t cap = convert_address(umem, seg_addr, uint32_t)[-2];
+    uint32_t index = ((cap + 8) / 32) - 1;
+
+    /* NOTE: intentionally linking the user-facing v^2 address for easy reuse
+     * in the future. Every segment has room for at least 24 bytes. */
+    uint32_t head = rec[index];
+    *convert_address(umem, seg_addr, uint32_t) = head;
+    rec[index] = seg_addr;
+
+    if (head == 0)
+        recycler_mark(index);
+}
+
+inline void free_segment(uint8_t *umem, uint32_t seg_addr, uint32_t *rec)
 {
     uint32_t sys_addr = seg_addr - BOOK_SIZE;
 
     uint32_t *virt = convert_address(umem, sys_addr, uint32_t);
     uint32_t cap = *virt;
 
-    uint32_t index = ((cap + 8) / 32) - 1;
+    if (seg_is_large(cap))
+    {
+        free_large_segment(umem, seg_addr);
+        return;
+    }
 
-    /* NOTE: intentionally storing the user-facing v^2 address in the stack
-     * for easy reuse in the future */
-    rec[index] = stack_push(rec[index], seg_addr);
+    /* Large segments are cheaper to let the kernel zero, page by page, as
+     * they are touched again, and small ones to the zeroer if it runs */
+    if (cap >= page_zero_min)
+    {
+        virt[1] = drop_segment_pages(umem, seg_addr, cap);
+    }
+    else
+    {
+        virt[1] = SEG_FREE;
+        if (background_zeroing && zero_later(seg_addr))
+            return;
+    }
+
+    recycler_push(umem, seg_addr, rec);
 }
 
 /* Memory system interface */
@@ -157,6 +259,8 @@ uint32_t kern_realloc(uint32_t size);
 
 void kern_memcpy(uint32_t src_addr, uint32_t copy_size);
 
+void virt_stats(VirtStats *stats);
+
 /* Virtual Segment Calloc (vs_calloc):
  * Carve out a segment of virtual memory and serve it to the program as
  * zeroed-out v^2 memory */
@@ -169,13 +273,17 @@ void kern_memcpy(uint32_t src_addr, uint32_t copy_size);
 // static inline uint32_t vs_calloc(uint8_t *umem, uint32_t size)
 static inline uint32_t vs_calloc(uint32_t size)
 {
-    /* Users may only ask vs_malloc for (2^24 - 8) bytes of contiguous space
-     * Omitted for performance reasons. The user must use our module correctly:
-     * assert(size < MAX_ALLOC); */
+    /* Sizes past MAX_ALLOC find their bucket empty, and go on to
+     * split_freed_segment like any other size that does */
+
+    /* Prefer a segment the zeroer has already cleared */
+    if (background_zeroing &&
+        __atomic_load_n(&rec_clean[get_idx_from_alloc_size(size)], __ATOMIC_RELAXED) != 0)
+        return pop_clean_segment(size);
 
     /* Look for segments to be recycled. If there are freed segments that are
      * ready to be recycled, recycled them */
-    uint32_t freed_seg = find_freed_segment(size, rec);
+    uint32_t freed_seg = find_freed_segment(usable, size, rec);
 
     /* check that a free segment is available */
     if (freed_seg != SEG_NOT_FOUND)
@@ -183,24 +291,29 @@ static inline uint32_t vs_calloc(uint32_t size)
         // uint32_t *freed_seg_addr = convert_address(umem, freed_seg, uint32_t);
         uint32_t *freed_seg_addr = convert_address(usable, freed_seg, uint32_t);
 
-        freed_seg_addr[-1] = size;
-
-        memset(freed_seg_addr, 0, size);
+        clear_recycled(freed_seg_addr, size);
 
         return freed_seg;
     }
 
-    /* If no segments can be recycled, carve a fresh one from the heap */
-    uint32_t user_start = start_unused + BOOK_SIZE;
+    /* Otherwise split a larger one, so freed memory is not stranded in
+     * buckets of sizes the program stopped asking for */
+    freed_seg = split_freed_segment(usable, size, rec);
+    if (freed_seg != SEG_NOT_FOUND)
+        return freed_seg;
 
+    /* If no segments can be recycled, carve a fresh one from the heap */
     /* Find the number of 32 byte blocks need to fill the allocation */
     uint32_t num_blocks = get_idx_from_alloc_size(size) + 1;
     uint32_t user_cap = (num_blocks * BLOCK_SIZE) - BOOK_SIZE;
 
-    /* Check that we still have enough 'carvable' memory in the heap.
-     * Add BOOK_SIZE to user start to account for kernel bookkeeping
-     * Omitting this for performance reasons:
-     * assert(GB4 - (user_start + BOOK_SIZE) >= user_cap); */
+    /* Check that we still have enough 'carvable' memory in the heap, below
+     * the large segments. Add BOOK_SIZE to account for the segment's
+     * bookkeeping */
+    if ((uint64_t)start_unused + BOOK_SIZE + user_cap > large_start)
+        return reclaim_segment(usable, size, rec);
+
+    uint32_t user_start = start_unused + BOOK_SIZE;
 
     /* Update the beginning of the unused heap */
     start_unused = user_start + user_cap;
@@ -237,10 +350,6 @@ inline uint32_t get_at(uint8_t *umem, uint32_t addr)
     return *src;
 }
 
-Stack_T stack_init(uint32_t size);
-
-void stack_free(Stack_T s);
-
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,401 @@
+/* Virt32 benchmarks (virt_bench):
+ * Times the allocator on its own, outside of any UM runtime.
+ *
+ *   ./virt_bench startup [runs]    init_memory_system to terminate_memory_system
+ *   ./virt_bench churn [runs]      random maps and unmaps over a live set
+ *   ./virt_bench shift [runs]      the same, with sizes that change over time
+ *   ./virt_bench exhaust [runs]    growing sizes that outrun the 4 GB arena
+ *   ./virt_bench zeroing [runs]    memset against dropped pages, by size
+ *   ./virt_bench background [runs] churn and shift, zeroing on map or on a second thread
+ *   ./virt_bench large [runs]      buffers past MAX_ALLOC among churn
+ */
+#include "virt.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Start-up latency: everything a runtime pays before its first instruction,
+ * plus a single map and unmap, and the teardown after its last */
+static void bench_startup(unsigned runs)
+{
+    double init = 0;
+    double first = 0;
+    double term = 0;
+
+    for (unsigned i = 0; i < runs; i++)
+    {
+        double start = now();
+        init_memory_system(KERN_SIZE);
+        kern_realloc(4);
+        init += now() - start;
+
+        start = now();
+        vs_free(vs_calloc(4));
+        first += now() - start;
+
+        start = now();
+        terminate_memory_system();
+        term += now() - start;
+    }
+
+    printf("startup: %u runs\n", runs);
+    printf("  init       %10.3f ms\n", init * 1e3 / runs);
+    printf("  first map  %10.3f ms\n", first * 1e3 / runs);
+    printf("  terminate  %10.3f ms\n", term * 1e3 / runs);
+}
+
+/* A small generator, so every build sees the same sequence */
+static uint32_t next_random(uint64_t *state)
+{
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (uint32_t)(*state >> 33);
+}
+
+/* A mapped segment must read zero at both ends. Its last word is then given
+ * the segment's own address, which must still be there, along with its
+ * size, when it is unmapped; a segment mapped over it would have changed
+ * them. */
+static void check_map(uint32_t seg, uint32_t bytes)
+{
+    uint32_t *words = convert_address(usable, seg, uint32_t);
+    uint32_t last = (bytes - 1) / sizeof(uint32_t);
+
+    assert(words[-1] == bytes);
+    assert(words[0] == 0 && words[last] == 0);
+    words[last] = seg;
+}
+
+static void check_unmap(uint32_t seg)
+{
+    uint32_t *words = convert_address(usable, seg, uint32_t);
+    uint32_t last = (words[-1] - 1) / sizeof(uint32_t);
+
+    assert(words[last] == seg);
+    vs_free(seg);
+}
+
+#define CHURN_SLOTS 4096
+#define CHURN_STEPS 4000000
+
+/* Map/unmap churn: a live set of segments, each slot freed or refilled in
+ * turn. Sizes are mostly a few words, as in sandmark, with a tail of larger
+ * arrays. When shifting, the sizes move down every phase, so segments freed
+ * in one phase never fit the next exactly. */
+#define SHIFT_PHASE 250000
+
+static void bench_churn(unsigned runs, bool shift, bool background)
+{
+    static uint32_t live[CHURN_SLOTS];
+    double total = 0;
+    uint64_t heap = 0;
+
+    for (unsigned run = 0; run < runs; run++)
+    {
+        uint64_t state = 42;
+        init_memory_system(KERN_SIZE);
+        kern_realloc(4);
+        memset(live, 0, sizeof(live));
+        if (background && !start_background_zeroing())
+        {
+            fprintf(stderr, "Could not start the zeroing thread\n");
+            exit(EXIT_FAILURE);
+        }
+
+        double start = now();
+        for (uint32_t step = 0; step < CHURN_STEPS; step++)
+        {
+            uint32_t r = next_random(&state);
+            uint32_t slot = r % CHURN_SLOTS;
+
+            if (live[slot] != 0)
+            {
+                check_unmap(live[slot]);
+                live[slot] = 0;
+                continue;
+            }
+
+            uint32_t words = 1 + (r >> 12) % 16;
+            if ((r >> 20) % 64 == 0)
+            {
+                words = 1 + (r >> 8) % 4096;
+            }
+            if (shift)
+            {
+                words += ((CHURN_STEPS - step) / SHIFT_PHASE) * 16;
+            }
+            live[slot] = vs_calloc(words * sizeof(uint32_t));
+            check_map(live[slot], words * sizeof(uint32_t));
+        }
+        total += now() - start;
+        heap = start_unused;
+
+        terminate_memory_system();
+    }
+
+    printf("%s%s: %u runs of %u steps\n", shift ? "shift" : "churn",
+           background ? ", zeroed in the background" : "", runs, CHURN_STEPS);
+    printf("  per step   %10.2f ns\n", total * 1e9 / runs / CHURN_STEPS);
+    printf("  heap       %10.2f MB\n", heap / 1048576.0);
+}
+
+static void print_stats(void)
+{
+    VirtStats stats;
+    virt_stats(&stats);
+
+    double fragmentation = 0;
+    if (stats.free_bytes > 0)
+    {
+        fragmentation = 1.0 - (double)stats.largest_extent / stats.free_bytes;
+    }
+
+    printf("  heap       %10.2f MB\n", stats.heap_bytes / 1048576.0);
+    printf("  free       %10.2f MB in %u segments, %u extents\n",
+           stats.free_bytes / 1048576.0, stats.free_segments, stats.free_extents);
+    printf("  largest    %10.2f MB free extent, %.1f%% fragmented\n",
+           stats.largest_extent / 1048576.0, fragmentation * 100);
+    printf("  compacted  %10u times\n", stats.compactions);
+}
+
+#define EXHAUST_SLOTS 8192
+#define EXHAUST_PHASE EXHAUST_SLOTS
+#define EXHAUST_STEPS (24 * EXHAUST_PHASE)
+
+/* Exhaustion: sizes grow every phase, so nothing freed in one phase fits the
+ * next without merging. Only a sliver of the heap is ever live, but more than
+ * 4 GB is mapped over the run. */
+static void bench_exhaust(unsigned runs)
+{
+    static uint32_t live[EXHAUST_SLOTS];
+    double total = 0;
+
+    for (unsigned run = 0; run < runs; run++)
+    {
+        uint64_t state = 42;
+        uint64_t mapped = 0;
+        init_memory_system(KERN_SIZE);
+        kern_realloc(4);
+        memset(live, 0, sizeof(live));
+
+        double start = now();
+        for (uint32_t step = 0; step < EXHAUST_STEPS; step++)
+        {
+            uint32_t r = next_random(&state);
+            uint32_t slot = r % EXHAUST_SLOTS;
+
+            if (live[slot] != 0)
+            {
+                check_unmap(live[slot]);
+            }
+
+            uint32_t words = (step / EXHAUST_PHASE + 1) * 1024 + (r >> 10) % 64;
+            live[slot] = vs_calloc(words * sizeof(uint32_t));
+            check_map(live[slot], words * sizeof(uint32_t));
+            mapped += words * sizeof(uint32_t);
+        }
+        total += now() - start;
+
+        if (run == runs - 1)
+        {
+            printf("exhaust: %u runs of %u steps, %.2f GB mapped\n",
+                   runs, EXHAUST_STEPS, mapped / 1073741824.0);
+            printf("  per step   %10.2f ns\n", total * 1e9 / runs / EXHAUST_STEPS);
+            print_stats();
+        }
+
+        terminate_memory_system();
+    }
+}
+
+#define ZEROING_BYTES ((uint64_t)1 << 30)
+
+/* One size remapped over and over: the recycled segment is zeroed either by
+ * memset or by dropping its pages on unmap, then written a word per page,
+ * all of it or only the first sixteenth */
+static double zeroing_cycle(uint32_t bytes, uint32_t threshold, uint32_t touched)
+{
+    uint32_t cycles = ZEROING_BYTES / bytes;
+    init_memory_system(KERN_SIZE);
+    kern_realloc(4);
+    page_zero_min = threshold;
+
+    /* The first map is fresh, every later one recycled */
+    vs_free(vs_calloc(bytes));
+
+    double start = now();
+    for (uint32_t i = 0; i < cycles; i++)
+    {
+        uint32_t seg = vs_calloc(bytes);
+        uint32_t *words = convert_address(usable, seg, uint32_t);
+        for (uint32_t offset = 0; offset < touched; offset += 4096)
+        {
+            words[offset / sizeof(uint32_t)] = i;
+        }
+        vs_free(seg);
+    }
+    double elapsed = (now() - start) / cycles;
+
+    page_zero_min = PAGE_ZERO_MIN;
+    terminate_memory_system();
+    return elapsed;
+}
+
+static void bench_zeroing(unsigned runs)
+{
+    printf("zeroing: best of %u runs, microseconds per map, touch and unmap\n", runs);
+    printf("  %10s %12s %12s %12s %12s\n", "bytes", "memset", "dropped",
+           "memset/16", "dropped/16");
+
+    for (uint32_t bytes = 4096; bytes <= MAX_ALLOC; bytes *= 4)
+    {
+        /* The largest size, as the last bucket has it */
+        if (bytes > MAX_ALLOC / 4 && bytes < MAX_ALLOC)
+        {
+            bytes = MAX_ALLOC;
+        }
+
+        double best[4] = {1e9, 1e9, 1e9, 1e9};
+        for (unsigned run = 0; run < runs; run++)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                uint32_t threshold = i % 2 ? 0 : UINT32_MAX;
+                uint32_t touched = i < 2 ? bytes : bytes / 16;
+                double t = zeroing_cycle(bytes, threshold, touched);
+                if (t < best[i])
+                {
+                    best[i] = t;
+                }
+            }
+        }
+
+        printf("  %10u %12.2f %12.2f %12.2f %12.2f\n", bytes, best[0] * 1e6,
+               best[1] * 1e6, best[2] * 1e6, best[3] * 1e6);
+    }
+}
+
+#define LARGE_BUFFERS 8
+#define LARGE_CYCLES 64
+
+/* Large segments: buffers of 16 to 128 MB mapped, touched a word per page
+ * and unmapped in turn, with a few small segments mapped in between, so the
+ * large ones are recycled among themselves while the heap below grows */
+static void bench_large(unsigned runs)
+{
+    uint32_t buffers[LARGE_BUFFERS];
+    double total = 0;
+    uint64_t mapped = 0;
+
+    for (unsigned run = 0; run < runs; run++)
+    {
+        uint64_t state = 42;
+        init_memory_system(KERN_SIZE);
+        kern_realloc(4);
+        memset(buffers, 0, sizeof(buffers));
+        mapped = 0;
+
+        double start = now();
+        for (uint32_t cycle = 0; cycle < LARGE_CYCLES; cycle++)
+        {
+            uint32_t r = next_random(&state);
+            uint32_t slot = r % LARGE_BUFFERS;
+            if (buffers[slot] != 0)
+            {
+                check_unmap(buffers[slot]);
+            }
+
+            uint32_t bytes = MAX_ALLOC + 1 + (r >> 4) % (7 * (MAX_ALLOC + 1));
+            buffers[slot] = vs_calloc(bytes);
+            check_map(buffers[slot], bytes);
+            uint8_t *buffer = convert_address(usable, buffers[slot], uint8_t);
+            for (uint32_t offset = 0; offset < bytes - sizeof(uint32_t); offset += 4096)
+            {
+                assert(buffer[offset] == 0);
+                buffer[offset] = 1;
+            }
+            mapped += bytes;
+
+            for (int i = 0; i < 64; i++)
+            {
+                vs_calloc(64);
+            }
+        }
+        total += now() - start;
+
+        if (run == runs - 1)
+        {
+            printf("large: %u runs of %u buffers, %.2f GB mapped\n",
+                   runs, LARGE_CYCLES, mapped / 1073741824.0);
+            printf("  per buffer %10.2f us\n", total * 1e6 / runs / LARGE_CYCLES);
+
+            VirtStats stats;
+            virt_stats(&stats);
+            printf("  large      %10.2f MB\n", stats.large_bytes / 1048576.0);
+            printf("  heap       %10.2f MB\n", stats.heap_bytes / 1048576.0);
+        }
+
+        terminate_memory_system();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s startup|churn|shift|exhaust|zeroing|background|large [runs]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    unsigned runs = argc > 2 ? (unsigned)atoi(argv[2]) : 20;
+    if (runs == 0)
+    {
+        runs = 1;
+    }
+
+    if (strcmp(argv[1], "startup") == 0)
+    {
+        bench_startup(runs);
+    }
+    else if (strcmp(argv[1], "churn") == 0)
+    {
+        bench_churn(runs, false, false);
+    }
+    else if (strcmp(argv[1], "shift") == 0)
+    {
+        bench_churn(runs, true, false);
+    }
+    else if (strcmp(argv[1], "exhaust") == 0)
+    {
+        bench_exhaust(runs);
+    }
+    else if (strcmp(argv[1], "zeroing") == 0)
+    {
+        bench_zeroing(runs);
+    }
+    else if (strcmp(argv[1], "background") == 0)
+    {
+        bench_churn(runs, false, false);
+        bench_churn(runs, false, true);
+        bench_churn(runs, true, false);
+        bench_churn(runs, true, true);
+    }
+    else if (strcmp(argv[1], "large") == 0)
+    {
+        bench_large(runs);
+    }
+    else
+    {
+        fprintf(stderr, "Unknown benchmark: %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
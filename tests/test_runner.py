@@ -7,8 +7,10 @@ Usage: ./test_runner.py <runtime_name> [test_suite]
 import json
 import os
 import platform
+import shutil
 import subprocess
 import sys
+import tempfile
 import time
 from typing import Dict, List, Optional, Tuple
 
@@ -132,7 +134,8 @@ class TestRunner:
             return False, f"Test program not found: {program_path}", 0.0
         
         # Prepare command
-        cmd = [executable, program_path]
+        args = [arg.replace("{cache_dir}", self.cache_dir) for arg in test.get("args", [])]
+        cmd = [executable, program_path] + args
         input_data = test.get("input")
         timeout = test.get("timeout", 30)
         expected_failure = test.get("expected_failure", False)
@@ -207,24 +210,36 @@ class TestRunner:
         passed_tests = 0
         total_time = 0.0
         
-        for suite_name, tests in suites_to_run.items():
-            print(f"\n📋 {suite_name.upper()} TESTS:")
-            
-            for test in tests:
-                total_tests += 1
-                test_name = test["name"]
+        # Tests run in order, so later ones can reuse what earlier ones cached
+        self.cache_dir = tempfile.mkdtemp(prefix="umlang-cache-")
+        
+        try:
+            for suite_name, tests in suites_to_run.items():
+                # Tests that pass runtime flags, or rely on one allocator,
+                # name the runtimes they apply to
+                tests = [t for t in tests if runtime_name in t.get("runtimes", [runtime_name])]
+                if not tests:
+                    continue
                 
-                success, message, exec_time = self.run_test(runtime_name, test)
-                total_time += exec_time
+                print(f"\n📋 {suite_name.upper()} TESTS:")
                 
-                if success:
-                    passed_tests += 1
-                    if test.get("benchmark", False):
-                        print(f"  ✅ {test_name} ({exec_time:.3f}s)")
+                for test in tests:
+                    total_tests += 1
+                    test_name = test["name"]
+                    
+                    success, message, exec_time = self.run_test(runtime_name, test)
+                    total_time += exec_time
+                    
+                    if success:
+                        passed_tests += 1
+                        if test.get("benchmark", False):
+                            print(f"  ✅ {test_name} ({exec_time:.3f}s)")
+                        else:
+                            print(f"  ✅ {test_name}")
                     else:
-                        print(f"  ✅ {test_name}")
-                else:
-                    print(f"  ❌ {test_name}: {message}")
+                        print(f"  ❌ {test_name}: {message}")
+        finally:
+            shutil.rmtree(self.cache_dir, ignore_errors=True)
         
         # Summary
         print(f"\n📊 SUMMARY:")